@@ -64,3 +64,43 @@ void BoundedBuffer::putItem(int new_item) {
 	data_available.notify_one();
 	pL.unlock();
 }
+
+/**
+ * Adds several items to the back of the buffer, taking the lock once for
+ * the whole batch instead of once per item. If the buffer fills up part way
+ * through, waits for space like putItem does.
+ *
+ * @param new_items The items to put in the buffer, in order.
+ */
+void BoundedBuffer::putItems(const std::vector<int> &new_items) {
+	if (new_items.empty())
+	{
+		return;
+	}
+	std::unique_lock<std::mutex> pL(shared_mutex);
+	for (int new_item : new_items)
+	{
+		while(count == capacity)
+		{
+			// let consumers at what we have added so far
+			data_available.notify_all();
+			space_available.wait(pL);
+		}
+		count++;
+		buffer.push(new_item);
+		head++;
+		if(head == capacity)
+		{
+			head = 0;
+		}
+	}
+	if (new_items.size() == 1)
+	{
+		data_available.notify_one();
+	}
+	else
+	{
+		data_available.notify_all();
+	}
+	pL.unlock();
+}
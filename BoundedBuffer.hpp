@@ -1,6 +1,7 @@
 #include <queue>
 #include <condition_variable>
 #include <mutex>
+#include <vector>
 
 
 /**
@@ -19,6 +20,7 @@ class BoundedBuffer {
 	  // public member functions (a.k.a. methods)
 	  int getItem();
 	  void putItem(int new_item);
+	  void putItems(const std::vector<int> &new_items);
 
   // begin section containing private (i.e. hidden) parts of the class
   private:
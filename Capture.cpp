@@ -0,0 +1,239 @@
+/**
+ * Implementation of the Capture class.
+ * See the associated header file (Capture.hpp) for the declaration of this
+ * class and the log layout.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+#include "Capture.hpp"
+
+static const char MAGIC[8] = {'T', 'S', 'C', 'A', 'P', '0', '1', '\n'};
+
+// size of the fixed part of every record
+static const size_t RECORD_HEADER = 1 + 4 + 8 + 4;
+
+bool Capture::active = false;
+uint64_t Capture::started_at = 0;
+uint32_t Capture::next_id = 0;
+std::mutex Capture::out_lock;
+std::ofstream Capture::out;
+
+/**
+ * What the calling thread knows about the connection it is handling.
+ */
+struct ConnectionState {
+	int sock = -1;
+	uint32_t id = 0;
+	std::string records;
+	uint64_t response_length = 0;
+	uint64_t response_hash = Capture::HASH_SEED;
+};
+static thread_local ConnectionState current;
+
+/**
+ * Opens the log file and turns capturing on.
+ *
+ * @param path Where to write the capture log.
+ */
+void Capture::start(const std::string &path) {
+	out.open(path, std::ios::binary | std::ios::trunc);
+	if (!out) {
+		perror("Opening capture file failed");
+		exit(1);
+	}
+	out.write(MAGIC, sizeof(MAGIC));
+	out.flush();
+
+	started_at = now();
+	active = true;
+}
+
+/**
+ * Microseconds on a monotonic clock.
+ */
+uint64_t Capture::now() {
+	using namespace std::chrono;
+	return duration_cast<microseconds>(
+			steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Continues an FNV-1a hash over more data.
+ *
+ * @param h The hash so far (HASH_SEED to begin).
+ * @param data The bytes to add.
+ * @param length Number of bytes to add.
+ * @return The updated hash.
+ */
+uint64_t Capture::hash(uint64_t h, const char *data, size_t length) {
+	for (size_t i = 0; i < length; ++i) {
+		h ^= static_cast<unsigned char>(data[i]);
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/**
+ * Serializes one record onto the end of dest.
+ */
+void Capture::appendRecord(std::string &dest, RecordType type, uint32_t id,
+		uint64_t ts, const char *payload, uint32_t length) {
+	char header[RECORD_HEADER];
+	header[0] = static_cast<char>(type);
+	memcpy(header + 1, &id, 4);
+	memcpy(header + 5, &ts, 8);
+	memcpy(header + 13, &length, 4);
+	dest.append(header, RECORD_HEADER);
+	dest.append(payload, length);
+}
+
+/**
+ * Starts recording a newly picked up connection on the calling thread. The
+ * OPEN record is stamped with the accept time, so time spent waiting for a
+ * worker is not mistaken for a gap in the client's arrivals.
+ *
+ * @param sock The client socket being handled.
+ * @param accepted_us When it was accepted (steady clock, microseconds), or 0
+ * if unknown.
+ */
+void Capture::beginConnection(int sock, uint64_t accepted_us) {
+	if (!active) {
+		return;
+	}
+	current.sock = sock;
+	{
+		std::lock_guard<std::mutex> guard(out_lock);
+		current.id = next_id++;
+	}
+	current.records.clear();
+	current.response_length = 0;
+	current.response_hash = HASH_SEED;
+	uint64_t opened = (accepted_us >= started_at) ? accepted_us : now();
+	appendRecord(current.records, OPEN, current.id, opened - started_at, "", 0);
+}
+
+/**
+ * Records bytes received from the client.
+ *
+ * @param data The raw request bytes.
+ * @param length Number of bytes received.
+ */
+void Capture::requestData(const char *data, size_t length) {
+	if (!active || current.sock < 0 || length == 0) {
+		return;
+	}
+	appendRecord(current.records, DATA, current.id, now() - started_at, data,
+			static_cast<uint32_t>(length));
+}
+
+/**
+ * Folds bytes sent to the client into the response length and hash.
+ *
+ * @param sock The socket the bytes were sent on; other sockets are ignored.
+ * @param data The bytes sent.
+ * @param length Number of bytes sent.
+ */
+void Capture::responseData(int sock, const char *data, size_t length) {
+	if (!active || sock != current.sock) {
+		return;
+	}
+	current.response_length += length;
+	current.response_hash = hash(current.response_hash, data, length);
+}
+
+/**
+ * Finishes the current connection and appends its records to the log.
+ */
+void Capture::endConnection() {
+	if (!active || current.sock < 0) {
+		return;
+	}
+	uint64_t ts = now() - started_at;
+
+	char summary[16];
+	memcpy(summary, &current.response_length, 8);
+	memcpy(summary + 8, &current.response_hash, 8);
+	appendRecord(current.records, RESPONSE, current.id, ts, summary,
+			sizeof(summary));
+	appendRecord(current.records, CLOSE, current.id, ts, "", 0);
+
+	{
+		std::lock_guard<std::mutex> guard(out_lock);
+		out.write(current.records.data(), current.records.size());
+		out.flush();
+	}
+	current.records.clear();
+	current.sock = -1;
+}
+
+/**
+ * Reads a capture log, returning its connections ordered by when they were
+ * opened. Exits with an error message if the file is not a capture log.
+ *
+ * @param path The capture log to read.
+ * @return The connections found in the log.
+ */
+std::vector<CapturedConnection> Capture::load(const std::string &path) {
+	std::ifstream in(path, std::ios::binary);
+	char magic[sizeof(MAGIC)];
+	if (!in.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+		std::cerr << path << " is not a torero-serve capture log\n";
+		exit(1);
+	}
+
+	std::map<uint32_t, CapturedConnection> by_id;
+	char header[RECORD_HEADER];
+	while (in.read(header, RECORD_HEADER)) {
+		uint32_t id, length;
+		uint64_t ts;
+		memcpy(&id, header + 1, 4);
+		memcpy(&ts, header + 5, 8);
+		memcpy(&length, header + 13, 4);
+
+		std::string payload(length, '\0');
+		if (length > 0 && !in.read(&payload[0], length)) {
+			std::cerr << path << ": truncated record, stopping here\n";
+			break;
+		}
+
+		CapturedConnection &conn = by_id[id];
+		conn.id = id;
+		switch (static_cast<RecordType>(header[0])) {
+			case OPEN:
+				conn.opened_at = ts;
+				break;
+			case DATA:
+				conn.chunk_times.push_back(ts);
+				conn.chunks.push_back(payload);
+				break;
+			case RESPONSE:
+				if (length == 16) {
+					conn.has_response = true;
+					memcpy(&conn.response_length, payload.data(), 8);
+					memcpy(&conn.response_hash, payload.data() + 8, 8);
+				}
+				break;
+			case CLOSE:
+				conn.closed_at = ts;
+				break;
+			default:
+				std::cerr << path << ": unknown record type, skipping\n";
+		}
+	}
+
+	std::vector<CapturedConnection> connections;
+	for (auto &entry : by_id) {
+		connections.push_back(entry.second);
+	}
+	std::sort(connections.begin(), connections.end(),
+			[](const CapturedConnection &a, const CapturedConnection &b) {
+				return a.opened_at < b.opened_at;
+			});
+	return connections;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+/**
+ * One connection read back from a capture log.
+ *
+ * Timestamps are microseconds since the capture started. The response is
+ * stored as a length and an FNV-1a hash, which is enough for a replay to tell
+ * whether the server still answers the same way without storing every file.
+ */
+struct CapturedConnection {
+	uint32_t id = 0;
+	uint64_t opened_at = 0;
+	uint64_t closed_at = 0;
+	std::vector<uint64_t> chunk_times;
+	std::vector<std::string> chunks;
+	bool has_response = false;
+	uint64_t response_length = 0;
+	uint64_t response_hash = 0;
+};
+
+/**
+ * Records the raw bytes of incoming requests into a compact binary log.
+ *
+ * Log layout: the 8-byte magic "TSCAP01\n" followed by records of
+ *     u8 type, u32 connection id, u64 timestamp (us), u32 length, payload
+ * in host byte order. Types are OPEN, DATA (raw request bytes), RESPONSE
+ * (u64 length + u64 hash) and CLOSE.
+ *
+ * A worker builds the records of the connection it is handling in a
+ * thread-local buffer and appends them to the log in one go when the
+ * connection closes, so capturing only takes the file lock once per
+ * connection.
+ */
+class Capture {
+  public:
+	  enum RecordType : uint8_t { OPEN = 1, DATA = 2, RESPONSE = 3, CLOSE = 4 };
+
+	  // turns capturing on; must be called before any worker threads start
+	  static void start(const std::string &path);
+	  static bool enabled() { return active; }
+
+	  // connection lifecycle, called by the worker handling the socket
+	  // accepted_us: when the connection was accepted, on the steady clock
+	  // in microseconds (as Tracer::now()); 0 means now
+	  static void beginConnection(int sock, uint64_t accepted_us);
+	  static void requestData(const char *data, size_t length);
+	  static void responseData(int sock, const char *data, size_t length);
+	  static void endConnection();
+
+	  // reads a capture log back, for the replay tool
+	  static std::vector<CapturedConnection> load(const std::string &path);
+
+	  // FNV-1a, chained through h so a response can be hashed piecewise
+	  static const uint64_t HASH_SEED = 14695981039346656037ULL;
+	  static uint64_t hash(uint64_t h, const char *data, size_t length);
+
+  private:
+	  static void appendRecord(std::string &dest, RecordType type, uint32_t id,
+			  uint64_t ts, const char *payload, uint32_t length);
+	  static uint64_t now();
+
+	  static bool active;
+	  static uint64_t started_at;
+	  static uint32_t next_id;
+	  static std::mutex out_lock;
+	  static std::ofstream out;
+};
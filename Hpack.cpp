@@ -0,0 +1,551 @@
+/**
+ * Implementation of HPACK header compression (RFC 7541).
+ * See the associated header file (Hpack.hpp) for the declarations.
+ */
+#include <mutex>
+
+#include "Hpack.hpp"
+
+using std::string;
+
+// every dynamic table entry costs its name and value plus this much
+static const size_t ENTRY_OVERHEAD = 32;
+
+struct StaticEntry {
+	const char *name;
+	const char *value;
+};
+
+// RFC 7541 Appendix A
+static const StaticEntry STATIC_TABLE[] = {
+	{":authority", ""},
+	{":method", "GET"},
+	{":method", "POST"},
+	{":path", "/"},
+	{":path", "/index.html"},
+	{":scheme", "http"},
+	{":scheme", "https"},
+	{":status", "200"},
+	{":status", "204"},
+	{":status", "206"},
+	{":status", "304"},
+	{":status", "400"},
+	{":status", "404"},
+	{":status", "500"},
+	{"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"},
+	{"accept-language", ""},
+	{"accept-ranges", ""},
+	{"accept", ""},
+	{"access-control-allow-origin", ""},
+	{"age", ""},
+	{"allow", ""},
+	{"authorization", ""},
+	{"cache-control", ""},
+	{"content-disposition", ""},
+	{"content-encoding", ""},
+	{"content-language", ""},
+	{"content-length", ""},
+	{"content-location", ""},
+	{"content-range", ""},
+	{"content-type", ""},
+	{"cookie", ""},
+	{"date", ""},
+	{"etag", ""},
+	{"expect", ""},
+	{"expires", ""},
+	{"from", ""},
+	{"host", ""},
+	{"if-match", ""},
+	{"if-modified-since", ""},
+	{"if-none-match", ""},
+	{"if-range", ""},
+	{"if-unmodified-since", ""},
+	{"last-modified", ""},
+	{"link", ""},
+	{"location", ""},
+	{"max-forwards", ""},
+	{"proxy-authenticate", ""},
+	{"proxy-authorization", ""},
+	{"range", ""},
+	{"referer", ""},
+	{"refresh", ""},
+	{"retry-after", ""},
+	{"server", ""},
+	{"set-cookie", ""},
+	{"strict-transport-security", ""},
+	{"transfer-encoding", ""},
+	{"user-agent", ""},
+	{"vary", ""},
+	{"via", ""},
+	{"www-authenticate", ""},
+};
+
+static const size_t STATIC_COUNT = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+// RFC 7541 Appendix B: code and bit length of every byte value, then EOS
+static const uint32_t HUFFMAN_CODES[257] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+	0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+	0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+	0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+	0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+	0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+	0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+	0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+	0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+	0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+	0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+	0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+	0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+	0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+	0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+	0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+	0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+	0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+	0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+	0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+	0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+	0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+	0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+	0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+	0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+	0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+	0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+	0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+	0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+	0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+	0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+	0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff,
+};
+
+static const uint8_t HUFFMAN_LENGTHS[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+static const int HUFFMAN_EOS = 256;
+
+/**
+ * Decoding tree for the Huffman code, built on first use. Node 0 is the
+ * root; a node with symbol >= 0 is a leaf.
+ */
+struct HuffmanNode {
+	int child[2] = {-1, -1};
+	int symbol = -1;
+};
+static std::vector<HuffmanNode> huffman_tree;
+static std::once_flag huffman_tree_built;
+
+static void buildHuffmanTree() {
+	huffman_tree.resize(1);
+	for (int symbol = 0; symbol <= HUFFMAN_EOS; ++symbol) {
+		int node = 0;
+		for (int bit = HUFFMAN_LENGTHS[symbol] - 1; bit >= 0; --bit) {
+			int branch = (HUFFMAN_CODES[symbol] >> bit) & 1;
+			if (huffman_tree[node].child[branch] < 0) {
+				huffman_tree[node].child[branch] = huffman_tree.size();
+				huffman_tree.emplace_back();
+			}
+			node = huffman_tree[node].child[branch];
+		}
+		huffman_tree[node].symbol = symbol;
+	}
+}
+
+/**
+ * Creates an empty dynamic table.
+ *
+ * @param max_size The most bytes (as HPACK counts them) the table may hold.
+ */
+HpackTable::HpackTable(size_t max_size) : max_size(max_size) {
+}
+
+/**
+ * Looks up an entry by its HPACK index.
+ *
+ * @param index 1..61 for the static table, 62 onwards for the dynamic one.
+ * @param header Receives the entry.
+ * @return False if the index does not refer to an entry.
+ */
+bool HpackTable::get(size_t index, Header &header) const {
+	if (index == 0) {
+		return false;
+	}
+	if (index <= STATIC_COUNT) {
+		header = Header(STATIC_TABLE[index - 1].name, STATIC_TABLE[index - 1].value);
+		return true;
+	}
+	index -= STATIC_COUNT + 1;
+	if (index >= entries.size()) {
+		return false;
+	}
+	header = entries[index];
+	return true;
+}
+
+/**
+ * Inserts a header at the front of the dynamic table, evicting old entries
+ * as needed. A header bigger than the whole table just empties it.
+ */
+void HpackTable::add(const Header &header) {
+	size_t entry_size = header.first.size() + header.second.size() + ENTRY_OVERHEAD;
+	if (entry_size > max_size) {
+		entries.clear();
+		size = 0;
+		return;
+	}
+	entries.push_front(header);
+	size += entry_size;
+	evict();
+}
+
+/**
+ * Changes the table's size limit, evicting entries that no longer fit.
+ */
+void HpackTable::setMaxSize(size_t new_max) {
+	max_size = new_max;
+	evict();
+}
+
+/**
+ * Drops the oldest entries until the table is within its size limit.
+ */
+void HpackTable::evict() {
+	while (size > max_size && !entries.empty()) {
+		const Header &oldest = entries.back();
+		size -= oldest.first.size() + oldest.second.size() + ENTRY_OVERHEAD;
+		entries.pop_back();
+	}
+}
+
+/**
+ * Searches both tables for a header, preferring an exact match.
+ */
+size_t HpackTable::find(const Header &header, bool &full_match) const {
+	size_t name_index = 0;
+	full_match = false;
+	for (size_t i = 0; i < STATIC_COUNT; ++i) {
+		if (header.first == STATIC_TABLE[i].name) {
+			if (header.second == STATIC_TABLE[i].value) {
+				full_match = true;
+				return i + 1;
+			}
+			if (name_index == 0) {
+				name_index = i + 1;
+			}
+		}
+	}
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (header.first == entries[i].first) {
+			if (header.second == entries[i].second) {
+				full_match = true;
+				return STATIC_COUNT + 1 + i;
+			}
+			if (name_index == 0) {
+				name_index = STATIC_COUNT + 1 + i;
+			}
+		}
+	}
+	return name_index;
+}
+
+/**
+ * Appends an integer with an N-bit prefix (RFC 7541 section 5.1).
+ *
+ * @param first_byte The flag bits that share the first byte with the prefix.
+ */
+void hpack::encodeInteger(string &out, uint8_t first_byte, int prefix_bits,
+		uint64_t value) {
+	uint64_t limit = (1u << prefix_bits) - 1;
+	if (value < limit) {
+		out += static_cast<char>(first_byte | value);
+		return;
+	}
+	out += static_cast<char>(first_byte | limit);
+	value -= limit;
+	while (value >= 128) {
+		out += static_cast<char>((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out += static_cast<char>(value);
+}
+
+/**
+ * Reads an integer with an N-bit prefix, advancing pos past it.
+ *
+ * @return False if the data ends early or the value is absurdly large.
+ */
+bool hpack::decodeInteger(const uint8_t *&pos, const uint8_t *end, int prefix_bits,
+		uint64_t &value) {
+	if (pos >= end) {
+		return false;
+	}
+	uint64_t limit = (1u << prefix_bits) - 1;
+	value = *pos++ & limit;
+	if (value < limit) {
+		return true;
+	}
+	for (int shift = 0; shift <= 28; shift += 7) {
+		if (pos >= end) {
+			return false;
+		}
+		uint8_t byte = *pos++;
+		value += static_cast<uint64_t>(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Number of bytes value takes once Huffman coded.
+ */
+size_t hpack::huffmanLength(const string &value) {
+	size_t bits = 0;
+	for (unsigned char c : value) {
+		bits += HUFFMAN_LENGTHS[c];
+	}
+	return (bits + 7) / 8;
+}
+
+/**
+ * Huffman codes a string, padding the last byte with the start of EOS.
+ */
+string hpack::huffmanEncode(const string &value) {
+	string out;
+	uint64_t bits = 0;
+	int pending = 0;
+	for (unsigned char c : value) {
+		bits = (bits << HUFFMAN_LENGTHS[c]) | HUFFMAN_CODES[c];
+		pending += HUFFMAN_LENGTHS[c];
+		while (pending >= 8) {
+			pending -= 8;
+			out += static_cast<char>(bits >> pending);
+		}
+	}
+	if (pending > 0) {
+		out += static_cast<char>((bits << (8 - pending)) | (0xff >> pending));
+	}
+	return out;
+}
+
+/**
+ * Decodes a Huffman coded string.
+ *
+ * @return False if the data contains EOS or is padded with anything other
+ * than up to 7 one bits.
+ */
+bool hpack::huffmanDecode(const uint8_t *data, size_t length, string &out) {
+	std::call_once(huffman_tree_built, buildHuffmanTree);
+
+	int node = 0;
+	int padding_bits = 0;
+	bool padding_all_ones = true;
+	for (size_t i = 0; i < length; ++i) {
+		for (int bit = 7; bit >= 0; --bit) {
+			int branch = (data[i] >> bit) & 1;
+			node = huffman_tree[node].child[branch];
+			if (node < 0) {
+				return false;
+			}
+			padding_bits++;
+			padding_all_ones = padding_all_ones && branch == 1;
+
+			int symbol = huffman_tree[node].symbol;
+			if (symbol >= 0) {
+				if (symbol == HUFFMAN_EOS) {
+					return false;
+				}
+				out += static_cast<char>(symbol);
+				node = 0;
+				padding_bits = 0;
+				padding_all_ones = true;
+			}
+		}
+	}
+	return padding_bits <= 7 && padding_all_ones;
+}
+
+/**
+ * Appends a string literal, Huffman coded when that makes it shorter.
+ */
+void hpack::encodeString(string &out, const string &value) {
+	size_t coded_length = huffmanLength(value);
+	if (coded_length < value.size()) {
+		encodeInteger(out, 0x80, 7, coded_length);
+		out += huffmanEncode(value);
+	}
+	else {
+		encodeInteger(out, 0x00, 7, value.size());
+		out += value;
+	}
+}
+
+/**
+ * Reads a (possibly Huffman coded) string literal, advancing pos past it.
+ */
+bool hpack::decodeString(const uint8_t *&pos, const uint8_t *end, string &value) {
+	if (pos >= end) {
+		return false;
+	}
+	bool huffman = (*pos & 0x80) != 0;
+	uint64_t length;
+	if (!decodeInteger(pos, end, 7, length) || length > static_cast<uint64_t>(end - pos)) {
+		return false;
+	}
+	value.clear();
+	if (huffman) {
+		if (!huffmanDecode(pos, length, value)) {
+			return false;
+		}
+	}
+	else {
+		value.assign(reinterpret_cast<const char*>(pos), length);
+	}
+	pos += length;
+	return true;
+}
+
+/**
+ * Decodes a complete header block (RFC 7541 section 6).
+ *
+ * @param data The concatenated HEADERS/CONTINUATION fragments.
+ * @param length Size of the block.
+ * @param headers Receives the decoded headers, in order.
+ * @return False on any compression error.
+ */
+bool HpackDecoder::decode(const uint8_t *data, size_t length,
+		std::vector<Header> &headers) {
+	const uint8_t *pos = data;
+	const uint8_t *end = data + length;
+	bool seen_header = false;
+
+	while (pos < end) {
+		uint8_t first = *pos;
+		uint64_t index;
+		Header header;
+
+		if (first & 0x80) {
+			// indexed header field
+			if (!hpack::decodeInteger(pos, end, 7, index) || !table.get(index, header)) {
+				return false;
+			}
+		}
+		else if ((first & 0xe0) == 0x20) {
+			// dynamic table size update; only allowed before any header
+			uint64_t new_size;
+			if (seen_header || !hpack::decodeInteger(pos, end, 5, new_size)
+					|| new_size > size_limit) {
+				return false;
+			}
+			table.setMaxSize(new_size);
+			continue;
+		}
+		else {
+			// literal: with incremental indexing (01), without indexing (0000)
+			// or never indexed (0001)
+			bool indexing = (first & 0xc0) == 0x40;
+			int prefix_bits = indexing ? 6 : 4;
+			if (!hpack::decodeInteger(pos, end, prefix_bits, index)) {
+				return false;
+			}
+			if (index == 0) {
+				if (!hpack::decodeString(pos, end, header.first)) {
+					return false;
+				}
+			}
+			else if (!table.get(index, header)) {
+				return false;
+			}
+			if (!hpack::decodeString(pos, end, header.second)) {
+				return false;
+			}
+			if (indexing) {
+				table.add(header);
+			}
+		}
+
+		seen_header = true;
+		headers.push_back(header);
+	}
+	return true;
+}
+
+/**
+ * Records the peer's table size limit. If it is smaller than what we use,
+ * the next block starts with a size update.
+ */
+void HpackEncoder::setMaxTableSize(size_t max_size) {
+	if (max_size < table.maxSize()) {
+		table.setMaxSize(max_size);
+		size_update_pending = true;
+	}
+}
+
+/**
+ * Encodes a header block. Exact matches become one-byte index references;
+ * everything else is sent as a literal and added to the dynamic table,
+ * except values that change on every response (which would only churn it).
+ *
+ * @param headers The headers to encode, names in lower case.
+ * @return The header block.
+ */
+string HpackEncoder::encode(const std::vector<Header> &headers) {
+	string out;
+	if (size_update_pending) {
+		hpack::encodeInteger(out, 0x20, 5, table.maxSize());
+		size_update_pending = false;
+	}
+
+	for (const Header &header : headers) {
+		bool full_match;
+		size_t index = table.find(header, full_match);
+		if (full_match) {
+			hpack::encodeInteger(out, 0x80, 7, index);
+			continue;
+		}
+
+		bool volatile_value = header.first == "content-length"
+			|| header.first == ":path" || header.first == "date";
+		if (volatile_value) {
+			hpack::encodeInteger(out, 0x00, 4, index);
+		}
+		else {
+			hpack::encodeInteger(out, 0x40, 6, index);
+			table.add(header);
+		}
+		if (index == 0) {
+			hpack::encodeString(out, header.first);
+		}
+		hpack::encodeString(out, header.second);
+	}
+	return out;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+// a header as (lower-case name, value)
+typedef std::pair<std::string, std::string> Header;
+
+
+/**
+ * The HPACK (RFC 7541) index space: the 61-entry static table followed by
+ * a dynamic table whose oldest entries are evicted to stay within max_size.
+ */
+class HpackTable {
+  public:
+	  HpackTable(size_t max_size);
+
+	  // looks up a (1-based) index; returns false if it is out of range
+	  bool get(size_t index, Header &header) const;
+	  void add(const Header &header);
+	  void setMaxSize(size_t new_max);
+	  size_t maxSize() const { return max_size; }
+
+	  // index of an exact match, or of a name-only match (0 if neither);
+	  // full_match says which one was found
+	  size_t find(const Header &header, bool &full_match) const;
+
+  private:
+	  void evict();
+
+	  std::deque<Header> entries; // newest first
+	  size_t size = 0;
+	  size_t max_size;
+};
+
+/**
+ * Decodes header blocks for one direction of a connection.
+ */
+class HpackDecoder {
+  public:
+	  HpackDecoder(size_t max_table_size) : table(max_table_size),
+		  size_limit(max_table_size) {}
+
+	  // decodes a complete header block; false means a compression error,
+	  // which is fatal for the connection
+	  bool decode(const uint8_t *data, size_t length, std::vector<Header> &headers);
+
+  private:
+	  HpackTable table;
+	  size_t size_limit; // the most the encoder may resize the table to
+};
+
+/**
+ * Encodes header blocks for one direction of a connection.
+ */
+class HpackEncoder {
+  public:
+	  HpackEncoder() : table(4096) {}
+
+	  std::string encode(const std::vector<Header> &headers);
+	  // the peer's SETTINGS_HEADER_TABLE_SIZE; announced in the next block
+	  void setMaxTableSize(size_t max_size);
+
+  private:
+	  HpackTable table;
+	  bool size_update_pending = false;
+};
+
+/**
+ * Shared HPACK primitives (also used by the test client).
+ */
+namespace hpack {
+	void encodeInteger(std::string &out, uint8_t first_byte, int prefix_bits,
+			uint64_t value);
+	bool decodeInteger(const uint8_t *&pos, const uint8_t *end, int prefix_bits,
+			uint64_t &value);
+	void encodeString(std::string &out, const std::string &value);
+	bool decodeString(const uint8_t *&pos, const uint8_t *end, std::string &value);
+	bool huffmanDecode(const uint8_t *data, size_t length, std::string &out);
+	std::string huffmanEncode(const std::string &value);
+	size_t huffmanLength(const std::string &value);
+}
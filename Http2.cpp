@@ -0,0 +1,684 @@
+/**
+ * Implementation of the HTTP/2 server session.
+ * See the associated header file (Http2.hpp) for the declarations.
+ */
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <system_error>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Http2.hpp"
+#include "Capture.hpp"
+#include "Tls.hpp"
+#include "Tracer.hpp"
+
+using std::string;
+
+// streams a client may have open at once
+static const uint32_t MAX_STREAMS = 100;
+// stop producing DATA frames while this much output is still unsent
+static const size_t OUTPUT_HIGH_WATER = 128 * 1024;
+// largest request header block (HEADERS plus CONTINUATIONs) we accept,
+// the same limit the proxy puts on a request head
+static const uint32_t MAX_HEADER_BLOCK = 64 * 1024;
+// an idle connection is closed after this long (it holds a worker meanwhile)
+static const int IDLE_TIMEOUT_MS = 10000;
+// longest a refused connection is kept to deliver the GOAWAY
+static const int REFUSE_LINGER_MS = 500;
+
+/**
+ * Creates a session for a connected client socket.
+ *
+ * @param sock The client socket (non-blocking).
+ * @param resolver Turns request paths into responses.
+ */
+Http2Session::Http2Session(int sock, Http2Resolver resolver)
+	: sock(sock), resolver(resolver), decoder(4096) {
+}
+
+/**
+ * Whether data is the connection preface or a prefix of it (so the caller
+ * knows to read more before deciding).
+ */
+bool Http2Session::looksLikePreface(const string &data) {
+	size_t n = std::min(data.size(), http2::PREFACE.size());
+	return n > 0 && data.compare(0, n, http2::PREFACE, 0, n) == 0;
+}
+
+/**
+ * Serves a prior-knowledge connection until the client goes away.
+ *
+ * @param initial Bytes already read from the socket, starting with the
+ * connection preface.
+ */
+void Http2Session::run(const string &initial) {
+	TraceSpan span("http2");
+	in = initial;
+	sendSettings();
+	loop();
+}
+
+/**
+ * Serves a connection that just upgraded from HTTP/1.1 (after the caller
+ * sent "101 Switching Protocols"). The upgrading request becomes stream 1.
+ *
+ * @param method The method of the upgrading request.
+ * @param path The path of the upgrading request.
+ * @param settings_header The HTTP2-Settings header of the request.
+ */
+void Http2Session::runUpgraded(const string &method, const string &path,
+		const string &settings_header) {
+	TraceSpan span("http2");
+	string settings = http2::base64UrlDecode(settings_header);
+	sendSettings();
+	try {
+		// acknowledged implicitly by the 101 response
+		applySettings(reinterpret_cast<const uint8_t*>(settings.data()),
+				settings.size() - settings.size() % 6);
+	}
+	catch (const ConnectionError &e) {
+		sendGoaway(e.code);
+		flushOutput();
+		return;
+	}
+	last_stream_id = 1;
+	startResponse(1, method, path);
+	loop();
+}
+
+/**
+ * Tells a prior-knowledge client that this connection will not be served.
+ * The GOAWAY names stream 0, so the client knows no request was processed
+ * and may retry it elsewhere.
+ *
+ * Closing a socket with unread input makes Linux send a reset, which can
+ * destroy the GOAWAY before the client reads it. So the output is flushed,
+ * our side is shut down, and whatever the client already sent is read and
+ * dropped until it closes too, all within REFUSE_LINGER_MS.
+ */
+void Http2Session::refuse() {
+	sendSettings();
+	sendGoaway(http2::NO_ERROR);
+
+	auto deadline = std::chrono::steady_clock::now()
+		+ std::chrono::milliseconds(REFUSE_LINGER_MS);
+	auto msLeft = [&deadline]() {
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now()).count();
+		return static_cast<int>(std::max<long long>(left, 0));
+	};
+
+	struct pollfd pfd;
+	pfd.fd = sock;
+	while (!out.empty() && flushOutput() && !out.empty() && msLeft() > 0) {
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		poll(&pfd, 1, msLeft());
+	}
+	shutdown(sock, SHUT_WR);
+
+	char buffer[4096];
+	while (msLeft() > 0) {
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, msLeft()) <= 0) {
+			break;
+		}
+		short wait_for;
+		ssize_t n = Tls::recv(sock, buffer, sizeof(buffer), wait_for);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			break;
+		}
+	}
+}
+
+/**
+ * Queues our SETTINGS frame; the defaults suit us apart from the stream
+ * and header size limits.
+ */
+void Http2Session::sendSettings() {
+	string payload;
+	payload += static_cast<char>(0);
+	payload += static_cast<char>(http2::MAX_CONCURRENT_STREAMS);
+	http2::appendUint32(payload, MAX_STREAMS);
+	payload += static_cast<char>(0);
+	payload += static_cast<char>(http2::MAX_HEADER_LIST_SIZE);
+	http2::appendUint32(payload, MAX_HEADER_BLOCK);
+	http2::appendFrame(out, http2::SETTINGS, 0, 0, payload);
+}
+
+/**
+ * Reads frames, answers requests and writes responses until the client
+ * closes the connection, says GOAWAY and has been fully answered, goes
+ * idle, or breaks the protocol.
+ */
+void Http2Session::loop() {
+	char buffer[16384];
+	try {
+		// frames that came in with the preface are already buffered and
+		// will not wake poll()
+		if (!in.empty()) {
+			processInput();
+		}
+		while (true) {
+			fillOutput();
+			if (out.empty() && streams.empty() && (peer_closed || goaway_received)) {
+				break;
+			}
+
+			struct pollfd pfd;
+			pfd.fd = sock;
+			pfd.events = (peer_closed ? 0 : POLLIN) | (out.empty() ? 0 : POLLOUT);
+			pfd.revents = 0;
+			if (pfd.events == 0) {
+				// peer is gone and nothing can be sent: streams are stuck
+				// waiting for window updates that will never come
+				break;
+			}
+			int ready = poll(&pfd, 1, IDLE_TIMEOUT_MS);
+			if (ready < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			if (ready == 0) {
+				sendGoaway(http2::NO_ERROR);
+				flushOutput();
+				break;
+			}
+
+			if ((pfd.revents & POLLOUT) && !flushOutput()) {
+				break;
+			}
+			if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+				short wait_for;
+				ssize_t n = Tls::recv(sock, buffer, sizeof(buffer), wait_for);
+				if (n > 0) {
+					Capture::requestData(buffer, n);
+					in.append(buffer, n);
+					processInput();
+				}
+				else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+					peer_closed = true;
+					if (n < 0) {
+						break;
+					}
+				}
+			}
+		}
+	}
+	catch (const ConnectionError &e) {
+		std::cerr << "http2: " << e.reason << "\n";
+		sendGoaway(e.code);
+		flushOutput();
+	}
+
+	for (auto &entry : streams) {
+		if (entry.second.file_fd >= 0) {
+			close(entry.second.file_fd);
+		}
+	}
+	streams.clear();
+}
+
+/**
+ * Checks the preface and handles every complete frame in the input buffer.
+ */
+void Http2Session::processInput() {
+	if (!preface_received) {
+		if (in.size() < http2::PREFACE.size()) {
+			if (!looksLikePreface(in)) {
+				throw ConnectionError{http2::PROTOCOL_ERROR, "bad connection preface"};
+			}
+			return;
+		}
+		if (in.compare(0, http2::PREFACE.size(), http2::PREFACE) != 0) {
+			throw ConnectionError{http2::PROTOCOL_ERROR, "bad connection preface"};
+		}
+		in.erase(0, http2::PREFACE.size());
+		preface_received = true;
+	}
+
+	size_t pos = 0;
+	while (in.size() - pos >= http2::FRAME_HEADER_SIZE) {
+		const uint8_t *header = reinterpret_cast<const uint8_t*>(in.data()) + pos;
+		uint32_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+		if (length > http2::DEFAULT_FRAME_SIZE) {
+			throw ConnectionError{http2::FRAME_SIZE_ERROR, "frame too large"};
+		}
+		if (in.size() - pos < http2::FRAME_HEADER_SIZE + length) {
+			break;
+		}
+		uint32_t stream_id = http2::readUint32(header + 5) & 0x7fffffff;
+		handleFrame(header[3], header[4], stream_id,
+				header + http2::FRAME_HEADER_SIZE, length);
+		pos += http2::FRAME_HEADER_SIZE + length;
+	}
+	in.erase(0, pos);
+}
+
+/**
+ * Handles one frame from the client.
+ */
+void Http2Session::handleFrame(uint8_t type, uint8_t flags, uint32_t stream_id,
+		const uint8_t *payload, uint32_t length) {
+	if (continuation_stream != 0
+			&& (type != http2::CONTINUATION || stream_id != continuation_stream)) {
+		throw ConnectionError{http2::PROTOCOL_ERROR, "expected CONTINUATION"};
+	}
+
+	switch (type) {
+		case http2::DATA: {
+			if (stream_id == 0) {
+				throw ConnectionError{http2::PROTOCOL_ERROR, "DATA on stream 0"};
+			}
+			// we don't take request bodies, but the client's windows must be
+			// refilled or it stalls
+			if (flags & http2::END_STREAM) {
+				receiving.erase(stream_id);
+			}
+			if (length > 0) {
+				string increment;
+				http2::appendUint32(increment, length);
+				http2::appendFrame(out, http2::WINDOW_UPDATE, 0, 0, increment);
+				if (receiving.count(stream_id)) {
+					http2::appendFrame(out, http2::WINDOW_UPDATE, 0, stream_id, increment);
+				}
+			}
+			break;
+		}
+
+		case http2::HEADERS: {
+			if (stream_id == 0 || stream_id % 2 == 0) {
+				throw ConnectionError{http2::PROTOCOL_ERROR, "bad HEADERS stream id"};
+			}
+			uint32_t skip = 0, padding = 0;
+			if (flags & http2::PADDED) {
+				if (length < 1) {
+					throw ConnectionError{http2::PROTOCOL_ERROR, "bad padding"};
+				}
+				padding = payload[0];
+				skip = 1;
+			}
+			if (flags & http2::PRIORITY_FLAG) {
+				skip += 5;
+			}
+			if (skip + padding > length) {
+				throw ConnectionError{http2::PROTOCOL_ERROR, "bad padding"};
+			}
+			header_block.assign(reinterpret_cast<const char*>(payload) + skip,
+					length - skip - padding);
+			if (flags & http2::END_HEADERS) {
+				handleHeaderBlock(stream_id, flags & http2::END_STREAM);
+			}
+			else {
+				continuation_stream = stream_id;
+				continuation_end_stream = flags & http2::END_STREAM;
+			}
+			break;
+		}
+
+		case http2::CONTINUATION:
+			if (continuation_stream == 0) {
+				throw ConnectionError{http2::PROTOCOL_ERROR, "unexpected CONTINUATION"};
+			}
+			if (header_block.size() + length > MAX_HEADER_BLOCK) {
+				throw ConnectionError{http2::ENHANCE_YOUR_CALM, "header block too large"};
+			}
+			header_block.append(reinterpret_cast<const char*>(payload), length);
+			if (flags & http2::END_HEADERS) {
+				continuation_stream = 0;
+				handleHeaderBlock(stream_id, continuation_end_stream);
+			}
+			break;
+
+		case http2::PRIORITY:
+			if (length != 5) {
+				throw ConnectionError{http2::FRAME_SIZE_ERROR, "bad PRIORITY"};
+			}
+			break;
+
+		case http2::RST_STREAM:
+			if (length != 4 || stream_id == 0) {
+				throw ConnectionError{http2::PROTOCOL_ERROR, "bad RST_STREAM"};
+			}
+			receiving.erase(stream_id);
+			if (streams.count(stream_id)) {
+				finishStream(stream_id);
+			}
+			break;
+
+		case http2::SETTINGS:
+			if (stream_id != 0 || length % 6 != 0) {
+				throw ConnectionError{http2::PROTOCOL_ERROR, "bad SETTINGS"};
+			}
+			if (!(flags & http2::ACK)) {
+				applySettings(payload, length);
+				http2::appendFrame(out, http2::SETTINGS, http2::ACK, 0, "");
+			}
+			break;
+
+		case http2::PUSH_PROMISE:
+			throw ConnectionError{http2::PROTOCOL_ERROR, "client sent PUSH_PROMISE"};
+
+		case http2::PING:
+			if (length != 8 || stream_id != 0) {
+				throw ConnectionError{http2::PROTOCOL_ERROR, "bad PING"};
+			}
+			if (!(flags & http2::ACK)) {
+				http2::appendFrame(out, http2::PING, http2::ACK, 0,
+						string(reinterpret_cast<const char*>(payload), 8));
+			}
+			break;
+
+		case http2::GOAWAY:
+			goaway_received = true;
+			break;
+
+		case http2::WINDOW_UPDATE: {
+			if (length != 4) {
+				throw ConnectionError{http2::FRAME_SIZE_ERROR, "bad WINDOW_UPDATE"};
+			}
+			uint32_t increment = http2::readUint32(payload) & 0x7fffffff;
+			if (increment == 0) {
+				throw ConnectionError{http2::PROTOCOL_ERROR, "zero WINDOW_UPDATE"};
+			}
+			if (stream_id == 0) {
+				connection_window += increment;
+				if (connection_window > http2::MAX_WINDOW) {
+					throw ConnectionError{http2::FLOW_CONTROL_ERROR, "window overflow"};
+				}
+			}
+			else if (streams.count(stream_id)) {
+				Stream &stream = streams[stream_id];
+				stream.send_window += increment;
+				if (stream.send_window > http2::MAX_WINDOW) {
+					throw ConnectionError{http2::FLOW_CONTROL_ERROR, "window overflow"};
+				}
+			}
+			break;
+		}
+
+		default:
+			// unknown frame types must be ignored
+			break;
+	}
+}
+
+/**
+ * Applies the client's SETTINGS (from a frame or the HTTP2-Settings header).
+ */
+void Http2Session::applySettings(const uint8_t *payload, uint32_t length) {
+	for (uint32_t i = 0; i + 6 <= length; i += 6) {
+		uint16_t id = (payload[i] << 8) | payload[i + 1];
+		uint32_t value = http2::readUint32(payload + i + 2);
+		switch (id) {
+			case http2::HEADER_TABLE_SIZE:
+				encoder.setMaxTableSize(value);
+				break;
+			case http2::INITIAL_WINDOW_SIZE: {
+				if (value > http2::MAX_WINDOW) {
+					throw ConnectionError{http2::FLOW_CONTROL_ERROR, "bad initial window"};
+				}
+				// open streams' windows move by the difference
+				int64_t delta = static_cast<int64_t>(value) - peer_initial_window;
+				for (auto &entry : streams) {
+					entry.second.send_window += delta;
+				}
+				peer_initial_window = value;
+				break;
+			}
+			case http2::MAX_FRAME_SIZE:
+				if (value < http2::DEFAULT_FRAME_SIZE || value > 0xffffff) {
+					throw ConnectionError{http2::PROTOCOL_ERROR, "bad max frame size"};
+				}
+				peer_max_frame = value;
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+/**
+ * Decodes a complete request header block and starts the response.
+ */
+void Http2Session::handleHeaderBlock(uint32_t stream_id, bool end_stream) {
+
+	std::vector<Header> headers;
+	if (!decoder.decode(reinterpret_cast<const uint8_t*>(header_block.data()),
+				header_block.size(), headers)) {
+		throw ConnectionError{http2::COMPRESSION_ERROR, "bad header block"};
+	}
+	header_block.clear();
+
+	if (stream_id <= last_stream_id) {
+		/*
+		 * Only trailers may arrive on a stream we have seen: a new stream
+		 * must use a higher id than any before it (RFC 9113 section 5.1.1),
+		 * and a stream whose request has ended takes no more headers.
+		 */
+		if (!receiving.count(stream_id)) {
+			throw ConnectionError{http2::PROTOCOL_ERROR, "HEADERS on a closed or reused stream"};
+		}
+		if (!end_stream) {
+			throw ConnectionError{http2::PROTOCOL_ERROR, "trailers without END_STREAM"};
+		}
+		receiving.erase(stream_id);
+		return;
+	}
+	last_stream_id = stream_id;
+	if (!end_stream && receiving.size() < MAX_STREAMS) {
+		receiving.insert(stream_id);
+	}
+
+	string method, path;
+	for (const Header &header : headers) {
+		if (header.first == ":method") {
+			method = header.second;
+		}
+		else if (header.first == ":path") {
+			path = header.second;
+		}
+	}
+
+	if (goaway_received || streams.size() >= MAX_STREAMS) {
+		string code;
+		http2::appendUint32(code, http2::REFUSED_STREAM);
+		http2::appendFrame(out, http2::RST_STREAM, 0, stream_id, code);
+		return;
+	}
+	startResponse(stream_id, method, path);
+}
+
+/**
+ * Resolves a request and queues its response HEADERS; the body follows as
+ * DATA frames from fillOutput().
+ */
+void Http2Session::startResponse(uint32_t stream_id, const string &method,
+		const string &path) {
+	TraceSpan span("h2_stream");
+	Stream stream;
+	stream.send_window = peer_initial_window;
+
+	if (method == "GET" || method == "HEAD") {
+		stream.response = resolver(path);
+	}
+	else {
+		stream.response.status = 400;
+	}
+
+	stream.file_fd = stream.response.file_fd;
+	stream.response.file_fd = -1;
+
+	if (stream.response.http1_only) {
+		string code;
+		http2::appendUint32(code, http2::HTTP_1_1_REQUIRED);
+		http2::appendFrame(out, http2::RST_STREAM, 0, stream_id, code);
+		return;
+	}
+
+	uint64_t length = stream.response.body.size();
+	if (stream.file_fd >= 0) {
+		struct stat info;
+		if (fstat(stream.file_fd, &info) < 0) {
+			close(stream.file_fd);
+			stream.file_fd = -1;
+			stream.response = Http2Response();
+			stream.response.status = 404;
+			length = 0;
+		}
+		else {
+			length = info.st_size;
+		}
+	}
+
+	std::vector<Header> headers;
+	headers.push_back(Header(":status", std::to_string(stream.response.status)));
+	if (!stream.response.content_type.empty()) {
+		headers.push_back(Header("content-type", stream.response.content_type));
+	}
+	headers.push_back(Header("content-length", std::to_string(length)));
+	string block = encoder.encode(headers);
+
+	stream.remaining = (method == "HEAD") ? 0 : length;
+	uint8_t end_flag = (stream.remaining == 0) ? http2::END_STREAM : 0;
+
+	// split the block if it does not fit in one frame
+	size_t first = std::min<size_t>(block.size(), peer_max_frame);
+	bool single = first == block.size();
+	http2::appendFrame(out, http2::HEADERS,
+			end_flag | (single ? http2::END_HEADERS : 0), stream_id,
+			block.substr(0, first));
+	for (size_t pos = first; pos < block.size(); pos += peer_max_frame) {
+		bool last = pos + peer_max_frame >= block.size();
+		http2::appendFrame(out, http2::CONTINUATION, last ? http2::END_HEADERS : 0,
+				stream_id, block.substr(pos, peer_max_frame));
+	}
+
+	if (stream.remaining == 0) {
+		if (stream.file_fd >= 0) {
+			close(stream.file_fd);
+		}
+		return;
+	}
+	streams[stream_id] = std::move(stream);
+}
+
+/**
+ * Produces DATA frames, one per ready stream per round, until the output
+ * buffer is full or every stream is blocked on flow control.
+ */
+void Http2Session::fillOutput() {
+	while (out.size() < OUTPUT_HIGH_WATER && connection_window > 0 && !streams.empty()) {
+		bool progress = false;
+
+		// rotate through the streams starting after the last one served
+		std::vector<uint32_t> order;
+		for (auto it = streams.upper_bound(last_served); it != streams.end(); ++it) {
+			order.push_back(it->first);
+		}
+		for (auto it = streams.begin(); it != streams.end() && it->first <= last_served; ++it) {
+			order.push_back(it->first);
+		}
+
+		for (uint32_t id : order) {
+			if (out.size() >= OUTPUT_HIGH_WATER || connection_window <= 0) {
+				break;
+			}
+			Stream &stream = streams[id];
+			if (stream.send_window <= 0) {
+				continue;
+			}
+
+			uint64_t chunk = std::min<uint64_t>(stream.remaining, peer_max_frame);
+			chunk = std::min<uint64_t>(chunk, stream.send_window);
+			chunk = std::min<uint64_t>(chunk, connection_window);
+
+			string payload;
+			if (stream.file_fd >= 0) {
+				payload.resize(chunk);
+				ssize_t got = pread(stream.file_fd, &payload[0], chunk, stream.offset);
+				if (got <= 0) {
+					// the file shrank under us; end the stream early
+					string code;
+					http2::appendUint32(code, http2::INTERNAL_ERROR);
+					http2::appendFrame(out, http2::RST_STREAM, 0, id, code);
+					finishStream(id);
+					continue;
+				}
+				payload.resize(got);
+			}
+			else {
+				payload = stream.response.body.substr(stream.offset, chunk);
+			}
+
+			stream.offset += payload.size();
+			stream.remaining -= payload.size();
+			stream.send_window -= payload.size();
+			connection_window -= payload.size();
+			bool done = stream.remaining == 0;
+			http2::appendFrame(out, http2::DATA, done ? http2::END_STREAM : 0, id, payload);
+			last_served = id;
+			progress = true;
+			if (done) {
+				finishStream(id);
+			}
+		}
+
+		if (!progress) {
+			break;
+		}
+	}
+}
+
+/**
+ * Forgets a stream whose response is complete (or that was reset).
+ */
+void Http2Session::finishStream(uint32_t stream_id) {
+	auto it = streams.find(stream_id);
+	if (it == streams.end()) {
+		return;
+	}
+	if (it->second.file_fd >= 0) {
+		close(it->second.file_fd);
+	}
+	streams.erase(it);
+}
+
+/**
+ * Writes as much pending output as the socket takes right now.
+ *
+ * @return False if the connection failed.
+ */
+bool Http2Session::flushOutput() {
+	while (!out.empty()) {
+		short wait_for;
+		ssize_t n = Tls::send(sock, out.data(), out.size(), wait_for);
+		if (n < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		Capture::responseData(sock, out.data(), n);
+		out.erase(0, n);
+	}
+	return true;
+}
+
+/**
+ * Queues a GOAWAY naming the last stream we processed.
+ */
+void Http2Session::sendGoaway(http2::ErrorCode code) {
+	string payload;
+	http2::appendUint32(payload, last_stream_id);
+	http2::appendUint32(payload, code);
+	http2::appendFrame(out, http2::GOAWAY, 0, 0, payload);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Hpack.hpp"
+#include "Http2Frame.hpp"
+
+
+/**
+ * What to send back for one HTTP/2 request.
+ */
+struct Http2Response {
+	int status = 200;
+	std::string content_type;
+	int file_fd = -1;	// body comes from this open file when set (the session closes it)...
+	std::string body;	// ...and from here otherwise
+	bool http1_only = false;	// refuse the stream; the client should retry over HTTP/1.1
+};
+
+// maps a request path to its response (supplied by the server)
+typedef std::function<Http2Response(const std::string &path)> Http2Resolver;
+
+/**
+ * The server side of one HTTP/2 connection.
+ *
+ * The session runs on the worker that picked up the connection. Requests
+ * on different streams are answered concurrently: each stream's response
+ * body is cut into DATA frames and the frames of all ready streams are sent
+ * round robin, within the connection and per-stream flow control windows.
+ */
+class Http2Session {
+  public:
+	  Http2Session(int sock, Http2Resolver resolver);
+
+	  // a client that starts with the connection preface ("prior knowledge")
+	  void run(const std::string &initial);
+	  // a client that upgraded with "Upgrade: h2c"; stream 1 is its request
+	  void runUpgraded(const std::string &method, const std::string &path,
+			  const std::string &settings_header);
+	  // turns the client away (SETTINGS, then GOAWAY) without serving it
+	  void refuse();
+
+	  // true if data could be (the start of) the connection preface
+	  static bool looksLikePreface(const std::string &data);
+
+  private:
+	  struct Stream {
+		  int64_t send_window = http2::DEFAULT_WINDOW;
+		  Http2Response response;
+		  int file_fd = -1;
+		  uint64_t offset = 0;
+		  uint64_t remaining = 0;
+	  };
+
+	  struct ConnectionError {
+		  http2::ErrorCode code;
+		  const char *reason;
+	  };
+
+	  void loop();
+	  void sendSettings();
+	  void processInput();
+	  void handleFrame(uint8_t type, uint8_t flags, uint32_t stream_id,
+			  const uint8_t *payload, uint32_t length);
+	  void applySettings(const uint8_t *payload, uint32_t length);
+	  void handleHeaderBlock(uint32_t stream_id, bool end_stream);
+	  void startResponse(uint32_t stream_id, const std::string &method,
+			  const std::string &path);
+	  void fillOutput();
+	  void finishStream(uint32_t stream_id);
+	  bool flushOutput();
+	  void sendGoaway(http2::ErrorCode code);
+
+	  int sock;
+	  Http2Resolver resolver;
+	  HpackDecoder decoder;
+	  HpackEncoder encoder;
+
+	  std::string in;
+	  std::string out;
+	  bool preface_received = false;
+	  bool peer_closed = false;
+	  bool goaway_received = false;
+
+	  // what the client told us in its SETTINGS
+	  uint32_t peer_initial_window = http2::DEFAULT_WINDOW;
+	  uint32_t peer_max_frame = http2::DEFAULT_FRAME_SIZE;
+	  int64_t connection_window = http2::DEFAULT_WINDOW;
+
+	  // a header block split over HEADERS + CONTINUATION frames
+	  uint32_t continuation_stream = 0;
+	  bool continuation_end_stream = false;
+	  std::string header_block;
+
+	  uint32_t last_stream_id = 0;
+	  uint32_t last_served = 0;
+	  std::map<uint32_t, Stream> streams;
+	  // streams whose request is still coming in (no END_STREAM from the
+	  // client yet); only these may get more DATA or trailing HEADERS
+	  std::set<uint32_t> receiving;
+};
@@ -0,0 +1,68 @@
+/**
+ * Implementation of the HTTP/2 framing helpers.
+ * See the associated header file (Http2Frame.hpp) for the declarations.
+ */
+#include "Http2Frame.hpp"
+
+using std::string;
+
+const string http2::PREFACE("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n");
+
+/**
+ * Appends a complete frame (9-byte header plus payload) to out.
+ */
+void http2::appendFrame(string &out, uint8_t type, uint8_t flags,
+		uint32_t stream_id, const string &payload) {
+	uint32_t length = payload.size();
+	out += static_cast<char>(length >> 16);
+	out += static_cast<char>(length >> 8);
+	out += static_cast<char>(length);
+	out += static_cast<char>(type);
+	out += static_cast<char>(flags);
+	appendUint32(out, stream_id & 0x7fffffff);
+	out += payload;
+}
+
+/**
+ * Reads a big-endian 32-bit value.
+ */
+uint32_t http2::readUint32(const uint8_t *p) {
+	return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/**
+ * Appends a big-endian 32-bit value.
+ */
+void http2::appendUint32(string &out, uint32_t value) {
+	out += static_cast<char>(value >> 24);
+	out += static_cast<char>(value >> 16);
+	out += static_cast<char>(value >> 8);
+	out += static_cast<char>(value);
+}
+
+/**
+ * Decodes unpadded base64url, as used by the HTTP2-Settings header.
+ * Invalid characters are skipped.
+ */
+string http2::base64UrlDecode(const string &in) {
+	string out;
+	uint32_t bits = 0;
+	int pending = 0;
+	for (char c : in) {
+		int value;
+		if (c >= 'A' && c <= 'Z') value = c - 'A';
+		else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+		else if (c >= '0' && c <= '9') value = c - '0' + 52;
+		else if (c == '-' || c == '+') value = 62;
+		else if (c == '_' || c == '/') value = 63;
+		else continue;
+
+		bits = (bits << 6) | value;
+		pending += 6;
+		if (pending >= 8) {
+			pending -= 8;
+			out += static_cast<char>(bits >> pending);
+		}
+	}
+	return out;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+
+/**
+ * HTTP/2 framing constants and helpers (RFC 7540) shared by the server and
+ * the test client. Kept apart from the server session so the client can be
+ * built from this and Hpack alone.
+ */
+namespace http2 {
+	// what a client sends first on a prior-knowledge connection
+	extern const std::string PREFACE;
+
+	enum FrameType : uint8_t {
+		DATA = 0x0, HEADERS = 0x1, PRIORITY = 0x2, RST_STREAM = 0x3,
+		SETTINGS = 0x4, PUSH_PROMISE = 0x5, PING = 0x6, GOAWAY = 0x7,
+		WINDOW_UPDATE = 0x8, CONTINUATION = 0x9
+	};
+
+	enum Flag : uint8_t {
+		END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8,
+		PRIORITY_FLAG = 0x20
+	};
+
+	enum Setting : uint16_t {
+		HEADER_TABLE_SIZE = 0x1, ENABLE_PUSH = 0x2, MAX_CONCURRENT_STREAMS = 0x3,
+		INITIAL_WINDOW_SIZE = 0x4, MAX_FRAME_SIZE = 0x5, MAX_HEADER_LIST_SIZE = 0x6
+	};
+
+	enum ErrorCode : uint32_t {
+		NO_ERROR = 0x0, PROTOCOL_ERROR = 0x1, INTERNAL_ERROR = 0x2,
+		FLOW_CONTROL_ERROR = 0x3, STREAM_CLOSED = 0x5, FRAME_SIZE_ERROR = 0x6,
+		REFUSED_STREAM = 0x7, COMPRESSION_ERROR = 0x9, ENHANCE_YOUR_CALM = 0xb,
+		HTTP_1_1_REQUIRED = 0xd
+	};
+
+	const size_t FRAME_HEADER_SIZE = 9;
+	const uint32_t DEFAULT_WINDOW = 65535;
+	const uint32_t DEFAULT_FRAME_SIZE = 16384;
+	const int64_t MAX_WINDOW = 0x7fffffff;
+
+	void appendFrame(std::string &out, uint8_t type, uint8_t flags,
+			uint32_t stream_id, const std::string &payload);
+	uint32_t readUint32(const uint8_t *p);
+	void appendUint32(std::string &out, uint32_t value);
+	std::string base64UrlDecode(const std::string &in);
+}
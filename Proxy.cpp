@@ -0,0 +1,826 @@
+/**
+ * Implementation of the Proxy class.
+ * See the associated header file (Proxy.hpp) for the declaration of this
+ * class.
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Proxy.hpp"
+#include "Capture.hpp"
+#include "Tracer.hpp"
+#include "Tls.hpp"
+
+using std::string;
+
+// largest request or response head we are willing to buffer
+static const size_t MAX_HEAD_SIZE = 64 * 1024;
+// idle upstream connections each worker keeps per route
+static const size_t MAX_IDLE_PER_ROUTE = 8;
+// how much one splice() call moves at most
+static const size_t SPLICE_CHUNK = 64 * 1024;
+
+std::vector<std::unique_ptr<ProxyRoute>> Proxy::routes;
+int Proxy::timeout_ms = 5000;
+
+// this worker's idle keep-alive connections, per route
+static thread_local std::map<const ProxyRoute*, std::vector<int>> idle_pool;
+// this worker's pipe for splicing between sockets
+static thread_local int relay_pipe[2] = {-1, -1};
+
+/**
+ * Human readable form of the upstream address, for log messages.
+ */
+string ProxyRoute::describe() const {
+	if (!unix_path.empty()) {
+		return prefix + " -> unix:" + unix_path;
+	}
+	return prefix + " -> " + host + ":" + std::to_string(port);
+}
+
+/**
+ * Throws the current errno as a std::system_error.
+ */
+static void throwErrno(const char *what) {
+	std::error_code ec(errno, std::generic_category());
+	throw std::system_error(ec, what);
+}
+
+/**
+ * Waits until fd is ready for events, throwing ETIMEDOUT if that takes
+ * longer than timeout_ms.
+ */
+static void waitFor(int fd, short events, int timeout_ms) {
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	while (true) {
+		int ready = poll(&pfd, 1, timeout_ms);
+		if (ready > 0) {
+			return;
+		}
+		if (ready == 0) {
+			std::error_code ec(ETIMEDOUT, std::generic_category());
+			throw std::system_error(ec, "proxy timed out");
+		}
+		if (errno != EINTR) {
+			throwErrno("poll failed");
+		}
+	}
+}
+
+/**
+ * Writes all of data to a non-blocking socket (TLS-encrypted if it is a TLS
+ * client connection).
+ */
+static void writeAll(int fd, const char *data, size_t length, int timeout_ms) {
+	size_t written = 0;
+	while (written < length) {
+		short wait_for;
+		ssize_t n = Tls::send(fd, data + written, length - written, wait_for);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				waitFor(fd, wait_for, timeout_ms);
+				continue;
+			}
+			throwErrno("proxy send failed");
+		}
+		written += n;
+	}
+}
+
+/**
+ * Sends bytes to the client, letting the capture log see them.
+ */
+static void sendToClient(int client_sock, const string &data, int timeout_ms) {
+	Capture::responseData(client_sock, data.data(), data.size());
+	writeAll(client_sock, data.data(), data.size(), timeout_ms);
+}
+
+/**
+ * Reads whatever is available from a non-blocking socket (waiting for at
+ * least one byte). Returns 0 when the peer has closed the connection.
+ */
+static size_t readSome(int fd, char *dest, size_t size, int timeout_ms) {
+	while (true) {
+		short wait_for;
+		ssize_t n = Tls::recv(fd, dest, size, wait_for);
+		if (n >= 0) {
+			return n;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			waitFor(fd, wait_for, timeout_ms);
+			continue;
+		}
+		throwErrno("proxy recv failed");
+	}
+}
+
+/**
+ * Sends a bodiless error response. Failures are ignored since the client
+ * connection is about to be closed anyway.
+ */
+static void sendStatus(int client_sock, const char *status, int timeout_ms) {
+	string response("HTTP/1.1 ");
+	response += status;
+	response += "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	try {
+		sendToClient(client_sock, response, timeout_ms);
+	}
+	catch (const std::system_error &) {
+	}
+}
+
+/**
+ * Case-insensitively finds a header in a request/response head and returns
+ * its (trimmed) value, or an empty string if it is absent.
+ */
+static string headerValue(const string &head, const string &name) {
+	size_t line = head.find("\r\n");
+	while (line != string::npos && line + 2 < head.size()) {
+		size_t start = line + 2;
+		size_t end = head.find("\r\n", start);
+		if (end == string::npos || end == start) {
+			break;
+		}
+		size_t colon = head.find(':', start);
+		if (colon != string::npos && colon < end && colon - start == name.size()
+				&& strncasecmp(head.c_str() + start, name.c_str(), name.size()) == 0) {
+			size_t value = head.find_first_not_of(" \t", colon + 1);
+			size_t value_end = head.find_last_not_of(" \t", end - 1);
+			if (value == string::npos || value > value_end) {
+				return "";
+			}
+			return head.substr(value, value_end - value + 1);
+		}
+		line = end;
+	}
+	return "";
+}
+
+/**
+ * Returns head with its hop-by-hop connection headers replaced by a single
+ * "Connection: <connection>" header.
+ */
+static string rewriteConnection(const string &head, const string &connection) {
+	string rewritten;
+	size_t start = 0;
+	bool first = true;
+	while (start < head.size()) {
+		size_t end = head.find("\r\n", start);
+		if (end == string::npos || end == start) {
+			break;
+		}
+		string line = head.substr(start, end - start);
+		start = end + 2;
+
+		if (!first) {
+			size_t colon = line.find(':');
+			string name = line.substr(0, colon);
+			std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+			if (name == "connection" || name == "keep-alive"
+					|| name == "proxy-connection") {
+				continue;
+			}
+		}
+		first = false;
+		rewritten += line + "\r\n";
+	}
+	rewritten += "Connection: " + connection + "\r\n\r\n";
+	return rewritten;
+}
+
+// parseLength results that are not lengths
+static const long long NO_LENGTH = -1;
+static const long long BAD_LENGTH = -2;
+
+/**
+ * Parses a Content-Length value.
+ *
+ * @return The length, NO_LENGTH if the header is missing, or BAD_LENGTH if
+ * it is not a number or too large to represent.
+ */
+static long long parseLength(const string &value) {
+	if (value.empty()) {
+		return NO_LENGTH;
+	}
+	if (value.find_first_not_of("0123456789") != string::npos) {
+		return BAD_LENGTH;
+	}
+	errno = 0;
+	long long length = strtoll(value.c_str(), nullptr, 10);
+	if (errno == ERANGE) {
+		return BAD_LENGTH;
+	}
+	return length;
+}
+
+/**
+ * Reads the status code from a response head ("HTTP/1.1 200 OK"), or 0.
+ */
+static int statusCode(const string &head) {
+	if (head.size() <= 12) {
+		return 0;
+	}
+	return atoi(head.c_str() + 9);
+}
+
+/**
+ * Walks a chunked body as it streams past and notices where it ends, so the
+ * upstream connection can be reused afterwards.
+ */
+struct ChunkScanner {
+	enum State { SIZE, EXTENSION, DATA, DATA_END, TRAILER };
+	State state = SIZE;
+	unsigned long long remaining = 0;
+	size_t line_length = 0;
+	bool done = false;
+
+	/**
+	 * Consumes up to length bytes and returns how many belong to the body
+	 * (fewer than length only once the end has been found).
+	 */
+	size_t feed(const char *data, size_t length) {
+		size_t i = 0;
+		while (i < length && !done) {
+			char c = data[i];
+			switch (state) {
+				case SIZE:
+				case EXTENSION:
+					if (c == '\n') {
+						state = (remaining == 0) ? TRAILER : DATA;
+						line_length = 0;
+					}
+					else if (state == SIZE && isxdigit(static_cast<unsigned char>(c))) {
+						remaining = remaining * 16
+							+ (isdigit(static_cast<unsigned char>(c)) ? c - '0' : (tolower(c) - 'a' + 10));
+					}
+					else if (c == ';') {
+						state = EXTENSION;
+					}
+					i++;
+					break;
+				case DATA: {
+					size_t take = std::min<unsigned long long>(remaining, length - i);
+					i += take;
+					remaining -= take;
+					if (remaining == 0) {
+						state = DATA_END;
+					}
+					break;
+				}
+				case DATA_END:
+					if (c == '\n') {
+						state = SIZE;
+					}
+					i++;
+					break;
+				case TRAILER:
+					if (c == '\n') {
+						if (line_length == 0) {
+							done = true;
+						}
+						line_length = 0;
+					}
+					else if (c != '\r') {
+						line_length++;
+					}
+					i++;
+					break;
+			}
+		}
+		return i;
+	}
+};
+
+/**
+ * Throws away this thread's relay pipe (e.g. after an error left data in it).
+ */
+static void resetPipe() {
+	if (relay_pipe[0] >= 0) {
+		close(relay_pipe[0]);
+		close(relay_pipe[1]);
+	}
+	relay_pipe[0] = relay_pipe[1] = -1;
+}
+
+/**
+ * Moves up to limit bytes from one socket to another through the relay pipe
+ * without copying them into user space. Returns the number of bytes moved,
+ * which is less than limit only if "from" reached end of stream.
+ */
+static unsigned long long spliceBetween(int from, int to, unsigned long long limit,
+		int timeout_ms) {
+	if (relay_pipe[0] < 0 && pipe2(relay_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+		throwErrno("creating relay pipe failed");
+	}
+
+	unsigned long long moved = 0;
+	try {
+		while (moved < limit) {
+			size_t want = std::min<unsigned long long>(limit - moved, SPLICE_CHUNK);
+			ssize_t in = splice(from, nullptr, relay_pipe[1], nullptr, want,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (in == 0) {
+				break;
+			}
+			if (in < 0) {
+				if (errno == EAGAIN || errno == EINTR) {
+					waitFor(from, POLLIN, timeout_ms);
+					continue;
+				}
+				throwErrno("splice from socket failed");
+			}
+
+			// the pipe is always emptied before filling it again
+			ssize_t left = in;
+			while (left > 0) {
+				ssize_t out = splice(relay_pipe[0], nullptr, to, nullptr, left,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (out < 0) {
+					if (errno == EAGAIN || errno == EINTR) {
+						waitFor(to, POLLOUT, timeout_ms);
+						continue;
+					}
+					throwErrno("splice to socket failed");
+				}
+				left -= out;
+			}
+			moved += in;
+		}
+	}
+	catch (const std::system_error &) {
+		resetPipe();
+		throw;
+	}
+	return moved;
+}
+
+/**
+ * Like spliceBetween, but copies through a buffer. Used when the capture log
+ * needs to see the bytes going to the client.
+ */
+static unsigned long long copyBetween(int from, int to, unsigned long long limit,
+		int timeout_ms) {
+	char buffer[16384];
+	unsigned long long moved = 0;
+	while (moved < limit) {
+		size_t want = std::min<unsigned long long>(limit - moved, sizeof(buffer));
+		size_t n = readSome(from, buffer, want, timeout_ms);
+		if (n == 0) {
+			break;
+		}
+		Capture::responseData(to, buffer, n);
+		writeAll(to, buffer, n, timeout_ms);
+		moved += n;
+	}
+	return moved;
+}
+
+/**
+ * Relays exactly limit bytes (or everything until end of stream, if limit is
+ * the maximum value) from one socket to another. Splicing is only possible
+ * when whatever is written to "to" goes out as is (plaintext or kTLS).
+ */
+static unsigned long long relay(int from, int to, unsigned long long limit,
+		int timeout_ms) {
+	if (Capture::enabled() || !Tls::kernelSend(to)) {
+		return copyBetween(from, to, limit, timeout_ms);
+	}
+	return spliceBetween(from, to, limit, timeout_ms);
+}
+
+/**
+ * Adds a route from a "PREFIX=HOST:PORT" or "PREFIX=unix:PATH" spec. Exits
+ * with an error message if the spec is malformed or the host is unknown.
+ *
+ * @param spec The route as given on the command line.
+ */
+void Proxy::addRoute(const string &spec) {
+	size_t equals = spec.find('=');
+	if (equals == string::npos || equals == 0 || spec[0] != '/') {
+		std::cerr << "Bad proxy route (want /prefix=host:port or /prefix=unix:path): "
+			<< spec << "\n";
+		exit(1);
+	}
+
+	std::unique_ptr<ProxyRoute> route(new ProxyRoute());
+	route->prefix = spec.substr(0, equals);
+	string target = spec.substr(equals + 1);
+	memset(&route->addr, 0, sizeof(route->addr));
+
+	if (target.compare(0, 5, "unix:") == 0) {
+		route->unix_path = target.substr(5);
+		struct sockaddr_un *addr = (struct sockaddr_un*)&route->addr;
+		if (route->unix_path.empty() || route->unix_path.size() >= sizeof(addr->sun_path)) {
+			std::cerr << "Bad Unix socket path in proxy route: " << spec << "\n";
+			exit(1);
+		}
+		addr->sun_family = AF_UNIX;
+		strcpy(addr->sun_path, route->unix_path.c_str());
+		route->addr_len = sizeof(struct sockaddr_un);
+	}
+	else {
+		size_t colon = target.rfind(':');
+		if (colon == string::npos) {
+			std::cerr << "Missing port in proxy route: " << spec << "\n";
+			exit(1);
+		}
+		route->host = target.substr(0, colon);
+		route->port = std::stoi(target.substr(colon + 1));
+
+		struct addrinfo hints, *found;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(route->host.c_str(), nullptr, &hints, &found) != 0) {
+			std::cerr << "Unknown host in proxy route: " << spec << "\n";
+			exit(1);
+		}
+		struct sockaddr_in *addr = (struct sockaddr_in*)&route->addr;
+		memcpy(addr, found->ai_addr, sizeof(struct sockaddr_in));
+		addr->sin_port = htons(route->port);
+		route->addr_len = sizeof(struct sockaddr_in);
+		freeaddrinfo(found);
+	}
+
+	routes.push_back(std::move(route));
+}
+
+/**
+ * Finds the route with the longest prefix matching target. A prefix only
+ * matches at a path boundary, so "/api" matches "/api" and "/api/x" but not
+ * "/apis".
+ *
+ * @param target The request target (path and optional query).
+ * @return The matching route, or nullptr.
+ */
+const ProxyRoute *Proxy::match(const string &target) {
+	const ProxyRoute *best = nullptr;
+	for (const auto &route : routes) {
+		const string &prefix = route->prefix;
+		if (target.compare(0, prefix.size(), prefix) != 0) {
+			continue;
+		}
+		bool boundary = target.size() == prefix.size() || prefix.back() == '/'
+			|| target[prefix.size()] == '/' || target[prefix.size()] == '?';
+		if (boundary && (best == nullptr || prefix.size() > best->prefix.size())) {
+			best = route.get();
+		}
+	}
+	return best;
+}
+
+/**
+ * Opens a new non-blocking connection to the route's upstream, throwing a
+ * std::system_error if that fails or times out.
+ */
+int Proxy::connectBackend(const ProxyRoute &route) {
+	int family = route.unix_path.empty() ? AF_INET : AF_UNIX;
+	int sock = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		throwErrno("creating upstream socket failed");
+	}
+
+	try {
+		if (connect(sock, (const struct sockaddr*)&route.addr, route.addr_len) < 0) {
+			if (errno != EINPROGRESS && errno != EAGAIN) {
+				throwErrno("connecting to upstream failed");
+			}
+			waitFor(sock, POLLOUT, timeout_ms);
+
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length);
+			if (error != 0) {
+				errno = error;
+				throwErrno("connecting to upstream failed");
+			}
+		}
+	}
+	catch (const std::system_error &) {
+		close(sock);
+		throw;
+	}
+
+	if (family == AF_INET) {
+		// request heads are small; don't let Nagle hold them back
+		int on = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	return sock;
+}
+
+/**
+ * Takes an idle connection to the route's upstream from this worker's pool,
+ * or returns -1 if there is none. Connections the upstream has closed (or
+ * sent unexpected bytes on) while idle are discarded.
+ */
+int Proxy::takePooled(const ProxyRoute &route) {
+	std::vector<int> &idle = idle_pool[&route];
+	while (!idle.empty()) {
+		int sock = idle.back();
+		idle.pop_back();
+
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) == 0) {
+			return sock;
+		}
+		close(sock);
+	}
+	return -1;
+}
+
+/**
+ * Puts a connection whose last response was fully read back into this
+ * worker's pool for the route.
+ */
+void Proxy::returnPooled(const ProxyRoute &route, int sock) {
+	std::vector<int> &idle = idle_pool[&route];
+	if (idle.size() >= MAX_IDLE_PER_ROUTE) {
+		close(sock);
+		return;
+	}
+	idle.push_back(sock);
+}
+
+/**
+ * Forwards a request to the route's upstream and relays the response.
+ *
+ * The request head is completed from the client if needed and sent upstream
+ * with "Connection: keep-alive"; the response goes back to the client with
+ * "Connection: close" since the client connection ends after one response.
+ * If the upstream sends nothing at all on a pooled connection (it timed out
+ * the idle connection just as we used it) the request is retried once on a
+ * fresh connection.
+ *
+ * @param route The route the request matched.
+ * @param client_sock The client's (non-blocking) socket.
+ * @param request The bytes of the request read so far.
+ */
+void Proxy::forward(const ProxyRoute &route, int client_sock, string request) {
+	TraceSpan span("proxy");
+
+	if (!route.healthy) {
+		sendStatus(client_sock, "503 Service Unavailable", timeout_ms);
+		return;
+	}
+
+	char buffer[16384];
+	size_t head_end;
+	while ((head_end = request.find("\r\n\r\n")) == string::npos) {
+		if (request.size() > MAX_HEAD_SIZE) {
+			sendStatus(client_sock, "431 Request Header Fields Too Large", timeout_ms);
+			return;
+		}
+		size_t n = readSome(client_sock, buffer, sizeof(buffer), timeout_ms);
+		if (n == 0) {
+			return; // client gave up
+		}
+		Capture::requestData(buffer, n);
+		request.append(buffer, n);
+	}
+
+	string head = request.substr(0, head_end + 4);
+	if (!headerValue(head, "Transfer-Encoding").empty()) {
+		sendStatus(client_sock, "411 Length Required", timeout_ms);
+		return;
+	}
+	long long body_length = parseLength(headerValue(head, "Content-Length"));
+	if (body_length == BAD_LENGTH) {
+		sendStatus(client_sock, "400 Bad Request", timeout_ms);
+		return;
+	}
+	if (body_length == NO_LENGTH) {
+		body_length = 0;
+	}
+	// anything past the body would be a pipelined request, which we don't do
+	string body_start = request.substr(head_end + 4, body_length);
+	bool body_buffered = static_cast<long long>(body_start.size()) == body_length;
+	bool head_request = head.compare(0, 5, "HEAD ") == 0;
+
+	string upstream_request = rewriteConnection(head, "keep-alive") + body_start;
+
+	/*
+	 * A client that sent "Expect: 100-continue" holds the body back until
+	 * it hears from us (curl does this for any body over 1 KiB). The
+	 * upstream's own 100 would only arrive after we had read the body, so
+	 * we answer for it.
+	 */
+	if (!body_buffered && strcasecmp(headerValue(head, "Expect").c_str(), "100-continue") == 0) {
+		sendToClient(client_sock, "HTTP/1.1 100 Continue\r\n\r\n", timeout_ms);
+	}
+
+	int backend = -1;
+	bool head_sent = false;
+	try {
+		string response;
+		for (int attempt = 0; ; ++attempt) {
+			// interim (1xx) responses read on this attempt, which then can't
+			// be a stale pooled connection
+			bool interim_seen = false;
+			backend = takePooled(route);
+			bool reused = backend >= 0;
+			if (!reused) {
+				backend = connectBackend(route);
+			}
+
+			bool stale = false;
+			try {
+				writeAll(backend, upstream_request.data(), upstream_request.size(), timeout_ms);
+				if (!body_buffered) {
+					unsigned long long rest = body_length - body_start.size();
+					if (copyBetween(client_sock, backend, rest, timeout_ms) != rest) {
+						close(backend);
+						return; // client went away mid-body
+					}
+				}
+
+				response.clear();
+				while (true) {
+					head_end = response.find("\r\n\r\n");
+					if (head_end != string::npos) {
+						int code = statusCode(response);
+						if (code < 100 || code >= 200 || code == 101) {
+							break;
+						}
+						// 100 Continue, 103 Early Hints...: the final
+						// response follows, and is all the client gets
+						response.erase(0, head_end + 4);
+						interim_seen = true;
+						continue;
+					}
+					if (response.size() > MAX_HEAD_SIZE) {
+						std::error_code ec(EPROTO, std::generic_category());
+						throw std::system_error(ec, "upstream response head too large");
+					}
+					size_t n = readSome(backend, buffer, sizeof(buffer), timeout_ms);
+					if (n == 0) {
+						if (reused && response.empty() && !interim_seen) {
+							stale = true;
+							break;
+						}
+						std::error_code ec(ECONNRESET, std::generic_category());
+						throw std::system_error(ec, "upstream closed early");
+					}
+					response.append(buffer, n);
+				}
+			}
+			catch (const std::system_error &e) {
+				int code = e.code().value();
+				if (!(reused && response.empty() && !interim_seen
+						&& (code == EPIPE || code == ECONNRESET))) {
+					throw;
+				}
+				stale = true;
+			}
+
+			if (!stale) {
+				break;
+			}
+			close(backend);
+			backend = -1;
+			if (attempt > 0 || !body_buffered) {
+				std::error_code ec(ECONNRESET, std::generic_category());
+				throw std::system_error(ec, "upstream closed pooled connection");
+			}
+		}
+
+		string response_head = response.substr(0, head_end + 4);
+		string excess = response.substr(head_end + 4);
+
+		int status = statusCode(response_head);
+		if (status == 101) {
+			// we asked for keep-alive, so the upstream had no business
+			// switching protocols, and we could not relay it if it did
+			std::error_code ec(EPROTO, std::generic_category());
+			throw std::system_error(ec, "upstream switched protocols");
+		}
+		bool upstream_http10 = response_head.compare(0, 8, "HTTP/1.0") == 0;
+		string connection = headerValue(response_head, "Connection");
+		bool reusable = !upstream_http10 && strcasecmp(connection.c_str(), "close") != 0;
+
+		long long length = parseLength(headerValue(response_head, "Content-Length"));
+		if (length == BAD_LENGTH) {
+			std::error_code ec(EPROTO, std::generic_category());
+			throw std::system_error(ec, "bad upstream Content-Length");
+		}
+
+		sendToClient(client_sock, rewriteConnection(response_head, "close"), timeout_ms);
+		head_sent = true;
+		bool chunked = strcasestr(headerValue(response_head, "Transfer-Encoding").c_str(),
+				"chunked") != nullptr;
+
+		if (head_request || status == 204 || status == 304) {
+			// no body follows
+			reusable = reusable && excess.empty();
+		}
+		else if (chunked) {
+			ChunkScanner scanner;
+			size_t used = scanner.feed(excess.data(), excess.size());
+			sendToClient(client_sock, excess.substr(0, used), timeout_ms);
+			reusable = reusable && used == excess.size();
+			while (!scanner.done) {
+				size_t n = readSome(backend, buffer, sizeof(buffer), timeout_ms);
+				if (n == 0) {
+					reusable = false;
+					break;
+				}
+				used = scanner.feed(buffer, n);
+				sendToClient(client_sock, string(buffer, used), timeout_ms);
+				reusable = reusable && used == n;
+			}
+		}
+		else if (length >= 0) {
+			unsigned long long already = std::min<unsigned long long>(excess.size(), length);
+			sendToClient(client_sock, excess.substr(0, already), timeout_ms);
+			// bytes past the declared length mean the upstream is confused
+			reusable = reusable && excess.size() <= static_cast<size_t>(length);
+			unsigned long long rest = length - already;
+			if (relay(backend, client_sock, rest, timeout_ms) != rest) {
+				reusable = false;
+			}
+		}
+		else {
+			// body runs until the upstream closes the connection
+			sendToClient(client_sock, excess, timeout_ms);
+			relay(backend, client_sock, ~0ULL, timeout_ms);
+			reusable = false;
+		}
+
+		if (reusable) {
+			returnPooled(route, backend);
+		}
+		else {
+			close(backend);
+		}
+	}
+	catch (const std::system_error &e) {
+		if (backend >= 0) {
+			close(backend);
+		}
+		if (!head_sent) {
+			bool timed_out = e.code().value() == ETIMEDOUT;
+			sendStatus(client_sock, timed_out ? "504 Gateway Timeout" : "502 Bad Gateway",
+					timeout_ms);
+		}
+		std::cerr << "proxy " << route.describe() << ": " << e.what() << "\n";
+	}
+}
+
+/**
+ * Starts a background thread that checks every upstream accepts
+ * connections, marking routes healthy or unhealthy.
+ *
+ * @param interval_ms Time between rounds of checks.
+ */
+void Proxy::startHealthChecks(int interval_ms) {
+	if (routes.empty() || interval_ms <= 0) {
+		return;
+	}
+	std::thread checker(healthCheckLoop, interval_ms);
+	checker.detach();
+}
+
+/**
+ * Body of the health check thread.
+ */
+void Proxy::healthCheckLoop(int interval_ms) {
+	while (true) {
+		for (const auto &route : routes) {
+			bool up = true;
+			try {
+				close(connectBackend(*route));
+			}
+			catch (const std::system_error &) {
+				up = false;
+			}
+
+			if (up != route->healthy.exchange(up)) {
+				std::cerr << "proxy " << route->describe() << " is "
+					<< (up ? "up" : "down") << "\n";
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+
+
+/**
+ * One path-prefix route to a local upstream server.
+ */
+struct ProxyRoute {
+	std::string prefix;		// e.g. "/api"
+	std::string host;		// host name or address; empty for Unix sockets
+	int port = 0;
+	std::string unix_path;	// set instead of host/port for Unix sockets
+	std::atomic<bool> healthy{true};
+
+	// resolved once at startup
+	struct sockaddr_storage addr;
+	socklen_t addr_len = 0;
+
+	std::string describe() const;
+};
+
+/**
+ * Reverse proxy for requests whose path starts with a configured prefix.
+ *
+ * Every worker thread keeps its own pool of idle keep-alive connections to
+ * each upstream, so forwarding a request normally costs no connect and no
+ * locking. Response bodies with a known length (or that run until the
+ * upstream closes) are moved to the client with splice() through a
+ * per-thread pipe instead of being copied through user space.
+ *
+ * All upstream I/O is bounded by a timeout, and a background thread
+ * periodically checks that every upstream accepts connections; requests for
+ * an upstream that is down get a 503 right away.
+ */
+class Proxy {
+  public:
+	  // configuration; must be done before any worker threads start
+	  static void addRoute(const std::string &spec);
+	  static void setTimeout(int ms) { timeout_ms = ms; }
+	  static void startHealthChecks(int interval_ms);
+	  static bool enabled() { return !routes.empty(); }
+
+	  // finds the route for a request target, or nullptr if there is none
+	  static const ProxyRoute *match(const std::string &target);
+
+	  // forwards one request (whose first bytes have already been read) and
+	  // relays the response back to the client
+	  static void forward(const ProxyRoute &route, int client_sock,
+			  std::string request);
+
+  private:
+	  static int connectBackend(const ProxyRoute &route);
+	  static int takePooled(const ProxyRoute &route);
+	  static void returnPooled(const ProxyRoute &route, int sock);
+	  static void healthCheckLoop(int interval_ms);
+
+	  static std::vector<std::unique_ptr<ProxyRoute>> routes;
+	  static int timeout_ms;
+};
@@ -0,0 +1,682 @@
+/**
+ * Implementation of the SiteIndex class.
+ * See the associated header file (SiteIndex.hpp) for the declaration of this
+ * class.
+ */
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SiteIndex.hpp"
+
+using std::string;
+using std::vector;
+
+// what the watch thread wants to hear about in every directory
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+	| IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+// most symbolic links followed while resolving one path
+static const int MAX_LINK_HOPS = 8;
+
+string SiteIndex::root;
+std::function<string(const string&)> SiteIndex::mime_type;
+std::unique_ptr<SiteIndex::Node> SiteIndex::tree;
+std::shared_mutex SiteIndex::tree_mutex;
+int SiteIndex::inotify_fd = -1;
+std::unordered_map<int, string> SiteIndex::watches;
+std::mutex SiteIndex::watches_mutex;
+
+// thread count used for the initial scan, reused if the index is rebuilt
+static int scan_threads = 1;
+
+/**
+ * Directories waiting to be scanned during a parallel build.
+ */
+struct SiteIndex::ScanQueue {
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::deque<std::pair<string, Node*>> pending;
+	int busy = 0;	// directories being scanned right now
+};
+
+/**
+ * Root-relative path ("" is the root) to the path on disk.
+ */
+static string diskPath(const string &root, const string &relative) {
+	return relative.empty() ? root : root + "/" + relative;
+}
+
+/**
+ * Appends a name to a root-relative directory path.
+ */
+static string joinPath(const string &relative, const string &name) {
+	return relative.empty() ? name : relative + "/" + name;
+}
+
+/**
+ * Splits a path into its components, dropping empty ones and ".". Returns
+ * false if any component is "..".
+ */
+static bool splitPath(const string &path, std::deque<string> &parts) {
+	size_t pos = 0;
+	while (pos <= path.size()) {
+		size_t end = path.find('/', pos);
+		if (end == string::npos) {
+			end = path.size();
+		}
+		string part = path.substr(pos, end - pos);
+		pos = end + 1;
+		if (part.empty() || part == ".") {
+			continue;
+		}
+		if (part == "..") {
+			return false;
+		}
+		parts.push_back(part);
+	}
+	return true;
+}
+
+/**
+ * Builds the index of root and starts the thread that keeps it current.
+ *
+ * @param root_dir The directory being served.
+ * @param threads How many threads scan directories in parallel.
+ * @param mime Maps a file name to its Content-Type.
+ */
+void SiteIndex::start(const string &root_dir, int threads,
+		std::function<string(const string&)> mime) {
+	char resolved[PATH_MAX];
+	if (realpath(root_dir.c_str(), resolved) == nullptr) {
+		perror("Resolving the root directory failed");
+		exit(1);
+	}
+	root = resolved;
+	mime_type = mime;
+	scan_threads = std::max(1, threads);
+
+	// watches are added while scanning, so nothing changes unnoticed between
+	// a directory being read and the watch thread starting
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		perror("inotify_init1 failed; the site index will not see changes");
+	}
+
+	auto started = std::chrono::steady_clock::now();
+	size_t entries = 0;
+	tree = build(scan_threads, entries);
+	double ms = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - started).count();
+	std::cout << "site index: " << entries << " entries under " << root << " in "
+		<< ms << " ms (" << scan_threads << " scan thread(s))\n";
+
+	if (inotify_fd >= 0) {
+		std::thread watcher(watchLoop);
+		watcher.detach();
+	}
+}
+
+/**
+ * Scans the whole root, handing subdirectories out to a pool of threads.
+ *
+ * @param threads Size of the pool.
+ * @param entries Set to the number of indexed entries.
+ * @return The root node of the new trie.
+ */
+std::unique_ptr<SiteIndex::Node> SiteIndex::build(int threads, size_t &entries) {
+	std::unique_ptr<Node> top(new Node());
+	top->kind = Node::DIRECTORY;
+
+	ScanQueue queue;
+	queue.pending.push_back(std::make_pair(string(), top.get()));
+	std::atomic<size_t> total(0);
+
+	auto worker = [&queue, &total]() {
+		size_t found = 0;
+		std::unique_lock<std::mutex> lock(queue.mutex);
+		while (true) {
+			queue.changed.wait(lock, [&queue]() {
+				return !queue.pending.empty() || queue.busy == 0;
+			});
+			if (queue.pending.empty()) {
+				break; // nothing queued and nobody left to queue more
+			}
+			std::pair<string, Node*> next = queue.pending.front();
+			queue.pending.pop_front();
+			queue.busy++;
+			lock.unlock();
+
+			scanDirectory(next.first, *next.second, &queue, found);
+
+			lock.lock();
+			queue.busy--;
+			queue.changed.notify_all();
+		}
+		total += found;
+	};
+
+	vector<std::thread> pool;
+	for (int i = 0; i < threads; ++i) {
+		pool.emplace_back(worker);
+	}
+	for (std::thread &t : pool) {
+		t.join();
+	}
+	entries = total;
+	return top;
+}
+
+/**
+ * Reads one directory into its node. Subdirectories are queued for the pool
+ * when queue is given and scanned recursively otherwise.
+ *
+ * @param relative The directory's root-relative path.
+ * @param dir Its (still empty) node.
+ * @param queue Where to put subdirectories, or nullptr.
+ * @param entries Incremented for every entry indexed.
+ */
+void SiteIndex::scanDirectory(const string &relative, Node &dir, ScanQueue *queue,
+		size_t &entries) {
+	watch(relative);
+
+	int dir_fd = open(diskPath(root, relative).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		return;
+	}
+	DIR *stream = fdopendir(dir_fd);
+	if (stream == nullptr) {
+		close(dir_fd);
+		return;
+	}
+
+	vector<std::pair<string, Node*>> subdirectories;
+	struct dirent *entry;
+	while ((entry = readdir(stream)) != nullptr) {
+		string name(entry->d_name);
+		if (name == "." || name == "..") {
+			continue;
+		}
+		bool is_dir;
+		std::unique_ptr<Node> node = makeNode(relative, name, dir_fd, is_dir);
+		if (!node) {
+			continue;
+		}
+		if (is_dir) {
+			subdirectories.push_back(std::make_pair(joinPath(relative, name), node.get()));
+		}
+		dir.children[name] = std::move(node);
+		entries++;
+	}
+	closedir(stream);
+	updateIndexFlag(dir);
+
+	if (queue != nullptr) {
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		for (auto &sub : subdirectories) {
+			queue->pending.push_back(sub);
+		}
+		queue->changed.notify_all();
+	}
+	else {
+		for (auto &sub : subdirectories) {
+			scanDirectory(sub.first, *sub.second, nullptr, entries);
+		}
+	}
+}
+
+/**
+ * Creates the node for one directory entry (without its children).
+ *
+ * @param relative Root-relative path of the containing directory.
+ * @param name The entry's name.
+ * @param dir_fd An open descriptor of the containing directory.
+ * @param is_dir Set if the entry is a directory that still has to be scanned.
+ * @return The node, or nullptr for entries that are not served (special
+ * files, links leaving the root, entries that vanished).
+ */
+std::unique_ptr<SiteIndex::Node> SiteIndex::makeNode(const string &relative,
+		const string &name, int dir_fd, bool &is_dir) {
+	is_dir = false;
+	struct stat info;
+	if (fstatat(dir_fd, name.c_str(), &info, AT_SYMLINK_NOFOLLOW) != 0) {
+		return nullptr;
+	}
+
+	std::unique_ptr<Node> node(new Node());
+	node->size = info.st_size;
+	node->mtime = info.st_mtime;
+	if (S_ISREG(info.st_mode)) {
+		node->kind = Node::FILE;
+		node->mime = mime_type(name);
+	}
+	else if (S_ISDIR(info.st_mode)) {
+		node->kind = Node::DIRECTORY;
+		is_dir = true;
+	}
+	else if (S_ISLNK(info.st_mode)) {
+		// only links whose final target stays inside the root are served
+		char resolved[PATH_MAX];
+		string full = diskPath(root, joinPath(relative, name));
+		if (realpath(full.c_str(), resolved) == nullptr) {
+			return nullptr;
+		}
+		string target(resolved);
+		if (target == root) {
+			target.clear();
+		}
+		else if (target.compare(0, root.size() + 1, root + "/") == 0) {
+			target.erase(0, root.size() + 1);
+		}
+		else {
+			return nullptr;
+		}
+		node->kind = Node::LINK;
+		node->link_target = target;
+	}
+	else {
+		return nullptr;
+	}
+	return node;
+}
+
+/**
+ * Recomputes whether a directory has an index.html.
+ */
+void SiteIndex::updateIndexFlag(Node &dir) {
+	auto it = dir.children.find("index.html");
+	dir.has_index = it != dir.children.end() && it->second->kind != Node::DIRECTORY;
+}
+
+/**
+ * Starts watching a directory (the watch follows it if it is renamed).
+ */
+void SiteIndex::watch(const string &relative) {
+	if (inotify_fd < 0) {
+		return;
+	}
+	int wd = inotify_add_watch(inotify_fd, diskPath(root, relative).c_str(), WATCH_MASK);
+	if (wd < 0) {
+		static std::atomic<bool> warned(false);
+		if (!warned.exchange(true)) {
+			perror("inotify_add_watch failed; some changes will go unnoticed");
+		}
+		return;
+	}
+	std::lock_guard<std::mutex> lock(watches_mutex);
+	watches[wd] = relative;
+}
+
+/**
+ * Stops watching a directory and everything below it. Used when it leaves
+ * the tree: otherwise its watches would keep reporting changes under the
+ * old path (or, once moved out of the root, for files we no longer serve).
+ */
+void SiteIndex::unwatch(const string &relative) {
+	if (inotify_fd < 0) {
+		return;
+	}
+	string prefix = relative + "/";
+	std::lock_guard<std::mutex> lock(watches_mutex);
+	for (auto it = watches.begin(); it != watches.end(); ) {
+		// "" is the root, below which everything lies
+		if (relative.empty() || it->second == relative
+				|| it->second.compare(0, prefix.size(), prefix) == 0) {
+			// the kernel may already have dropped it (EINVAL); either way
+			// the IN_IGNORED that follows finds nothing left to erase
+			inotify_rm_watch(inotify_fd, it->first);
+			it = watches.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+/**
+ * Walks the trie along a request path, following links.
+ *
+ * @param request_path The path to look up.
+ * @param relative Set to the root-relative path of the node found.
+ * @return The node, or nullptr if there is none (or the path tried to
+ * escape the root). The caller must hold tree_mutex.
+ */
+const SiteIndex::Node *SiteIndex::walk(const string &request_path, string &relative) {
+	std::deque<string> parts;
+	if (!splitPath(request_path, parts)) {
+		return nullptr;
+	}
+
+	const Node *node = tree.get();
+	relative.clear();
+	if (node == nullptr) {
+		return nullptr; // the root is gone
+	}
+	int hops = 0;
+	while (!parts.empty()) {
+		if (node->kind != Node::DIRECTORY) {
+			return nullptr;
+		}
+		auto it = node->children.find(parts.front());
+		if (it == node->children.end()) {
+			return nullptr;
+		}
+		const Node *child = it->second.get();
+		parts.pop_front();
+
+		if (child->kind == Node::LINK) {
+			// carry on from the link's target with whatever is left
+			if (++hops > MAX_LINK_HOPS) {
+				return nullptr;
+			}
+			std::deque<string> target;
+			splitPath(child->link_target, target);
+			parts.insert(parts.begin(), target.begin(), target.end());
+			node = tree.get();
+			relative.clear();
+			continue;
+		}
+		relative = joinPath(relative, it->first);
+		node = child;
+	}
+	return node;
+}
+
+/**
+ * Finds a directory node by its root-relative path, without following
+ * links. The caller must hold tree_mutex.
+ */
+SiteIndex::Node *SiteIndex::findDirectory(const string &relative) {
+	std::deque<string> parts;
+	if (!splitPath(relative, parts)) {
+		return nullptr;
+	}
+	Node *node = tree.get();
+	if (node == nullptr) {
+		return nullptr;
+	}
+	for (const string &part : parts) {
+		auto it = node->children.find(part);
+		if (it == node->children.end() || it->second->kind != Node::DIRECTORY) {
+			return nullptr;
+		}
+		node = it->second.get();
+	}
+	return node;
+}
+
+/**
+ * Looks up a request path.
+ *
+ * @param request_path The path from the request line (e.g. "/a/b.html").
+ * @return What is there; kind is MISSING if nothing is (or the path is not
+ * allowed).
+ */
+SiteEntry SiteIndex::resolve(const string &request_path) {
+	std::shared_lock<std::shared_mutex> lock(tree_mutex);
+	SiteEntry entry;
+	string relative;
+	const Node *node = walk(request_path, relative);
+	if (node == nullptr) {
+		return entry;
+	}
+
+	if (node->kind == Node::DIRECTORY) {
+		entry.kind = SiteEntry::DIRECTORY;
+		entry.mtime = node->mtime;
+		if (node->has_index) {
+			// index.html may itself be a link, so resolve it properly
+			string index_relative;
+			const Node *index = walk(joinPath(relative, "index.html"), index_relative);
+			if (index != nullptr && index->kind == Node::FILE) {
+				entry.has_index = true;
+				entry.path = diskPath(root, index_relative);
+				entry.size = index->size;
+				entry.mtime = index->mtime;
+				entry.mime = index->mime;
+			}
+		}
+		if (!entry.has_index) {
+			entry.path = diskPath(root, relative);
+		}
+	}
+	else {
+		entry.kind = SiteEntry::FILE;
+		entry.path = diskPath(root, relative);
+		entry.size = node->size;
+		entry.mtime = node->mtime;
+		entry.mime = node->mime;
+	}
+	return entry;
+}
+
+/**
+ * Lists a directory.
+ *
+ * @param request_path The directory's request path.
+ * @param names Filled with the entry names; subdirectories end in "/".
+ * @return False if request_path is not a directory.
+ */
+bool SiteIndex::list(const string &request_path, vector<string> &names) {
+	std::shared_lock<std::shared_mutex> lock(tree_mutex);
+	string relative;
+	const Node *node = walk(request_path, relative);
+	if (node == nullptr || node->kind != Node::DIRECTORY) {
+		return false;
+	}
+
+	for (const auto &child : node->children) {
+		const Node *target = child.second.get();
+		if (target->kind == Node::LINK) {
+			string ignored;
+			target = walk(target->link_target, ignored);
+			if (target == nullptr) {
+				continue;
+			}
+		}
+		names.push_back(child.first + (target->kind == Node::DIRECTORY ? "/" : ""));
+	}
+	return true;
+}
+
+/**
+ * Opens the file behind a FILE entry, or behind a directory entry's
+ * index.html. The index may be stale (a file swapped for a link is only
+ * noticed once its inotify event is handled, and not at all while the
+ * index is rebuilt after an overflow), so the path is opened one component
+ * at a time from the root with O_NOFOLLOW: a symbolic link anywhere along
+ * it makes the open fail instead of being followed. (The root is opened
+ * afresh each time: a descriptor kept open would stop inotify from ever
+ * reporting the root's deletion.)
+ *
+ * @param entry What resolve() returned.
+ * @return A read-only descriptor of a regular file, or -1 with errno set.
+ */
+int SiteIndex::openFile(const SiteEntry &entry) {
+	std::deque<string> parts;
+	if (entry.path.compare(0, root.size() + 1, root + "/") != 0
+			|| !splitPath(entry.path.substr(root.size() + 1), parts) || parts.empty()) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	int dir_fd = open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	while (dir_fd >= 0 && parts.size() > 1) {
+		int next = openat(dir_fd, parts.front().c_str(),
+				O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		close(dir_fd);
+		dir_fd = next;
+		parts.pop_front();
+	}
+	if (dir_fd < 0) {
+		return -1;
+	}
+	int fd = openat(dir_fd, parts.front().c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	int saved_errno = errno;
+	close(dir_fd);
+	if (fd < 0) {
+		errno = saved_errno;
+		return -1;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+		close(fd);
+		errno = EACCES;
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Applies inotify events to the trie until the process exits.
+ */
+void SiteIndex::watchLoop() {
+	// big enough for many events, aligned as inotify(7) asks
+	alignas(struct inotify_event) char buffer[64 * 1024];
+	while (true) {
+		ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			perror("Reading inotify events failed; the site index stops updating");
+			return;
+		}
+
+		for (char *p = buffer; p < buffer + n; ) {
+			struct inotify_event *event = reinterpret_cast<struct inotify_event*>(p);
+			p += sizeof(struct inotify_event) + event->len;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				// events were lost, so start over from a fresh scan; the old
+				// watches may name directories that are gone or have moved,
+				// so they are dropped and the scan adds them afresh
+				unwatch("");
+				size_t entries = 0;
+				std::unique_ptr<Node> fresh = build(scan_threads, entries);
+				std::unique_lock<std::shared_mutex> lock(tree_mutex);
+				tree = std::move(fresh);
+			}
+			else if (event->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+				// the directory itself is gone (or its watch was removed);
+				// IN_IGNORED follows IN_DELETE_SELF, but by then the watch
+				// is no longer in the table
+				bool is_root = false;
+				{
+					std::lock_guard<std::mutex> lock(watches_mutex);
+					auto it = watches.find(event->wd);
+					if (it != watches.end()) {
+						is_root = it->second.empty();
+						watches.erase(it);
+					}
+				}
+				if (is_root) {
+					rootRemoved();
+				}
+			}
+			else if (event->len > 0) {
+				applyEvent(event->wd, event->mask, string(event->name));
+			}
+		}
+	}
+}
+
+/**
+ * Drops the whole index once the root directory itself has been deleted,
+ * so every path (the root included) resolves to nothing. A directory
+ * created later under the same name is not picked up.
+ */
+void SiteIndex::rootRemoved() {
+	std::cerr << "site index: " << root << " was removed; nothing is served until restart\n";
+	std::unique_lock<std::shared_mutex> lock(tree_mutex);
+	tree.reset();
+}
+
+/**
+ * Updates the trie for one change to an entry of a watched directory.
+ *
+ * @param wd The watch the event arrived on.
+ * @param mask What happened.
+ * @param name The entry it happened to.
+ */
+void SiteIndex::applyEvent(int wd, uint32_t mask, const string &name) {
+	string relative;
+	{
+		std::lock_guard<std::mutex> lock(watches_mutex);
+		auto it = watches.find(wd);
+		if (it == watches.end()) {
+			return;
+		}
+		relative = it->second;
+	}
+
+	// work out the new state of the entry before taking the write lock
+	std::unique_ptr<Node> node;
+	bool is_dir = false;
+	bool fresh = mask & (IN_CREATE | IN_MOVED_TO);
+	if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+		if (mask & IN_ISDIR) {
+			// a move within the root watches it afresh on IN_MOVED_TO
+			unwatch(joinPath(relative, name));
+		}
+	}
+	else {
+		int dir_fd = open(diskPath(root, relative).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd >= 0) {
+			node = makeNode(relative, name, dir_fd, is_dir);
+			close(dir_fd);
+		}
+		if (node && is_dir && !fresh) {
+			// attribute changes on a directory we already have keep its
+			// contents; anything else gets scanned
+			std::shared_lock<std::shared_mutex> lock(tree_mutex);
+			bool known = false;
+			Node *dir = findDirectory(relative);
+			if (dir != nullptr) {
+				auto it = dir->children.find(name);
+				known = it != dir->children.end() && it->second->kind == Node::DIRECTORY;
+			}
+			fresh = !known;
+		}
+		if (node && is_dir && fresh) {
+			// a new (or moved in) directory: index what is already inside
+			size_t entries = 0;
+			scanDirectory(joinPath(relative, name), *node, nullptr, entries);
+		}
+	}
+
+	std::unique_lock<std::shared_mutex> lock(tree_mutex);
+	Node *dir = findDirectory(relative);
+	if (dir == nullptr) {
+		return;
+	}
+	auto existing = dir->children.find(name);
+	if (!node) {
+		if (existing != dir->children.end()) {
+			dir->children.erase(existing);
+		}
+	}
+	else {
+		if (is_dir && !fresh && existing != dir->children.end()
+				&& existing->second->kind == Node::DIRECTORY) {
+			// only the directory's own attributes changed; keep its contents
+			node->children = std::move(existing->second->children);
+			node->has_index = existing->second->has_index;
+		}
+		dir->children[name] = std::move(node);
+	}
+	updateIndexFlag(*dir);
+}
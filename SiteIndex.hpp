@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+/**
+ * What a request path resolved to.
+ */
+struct SiteEntry {
+	enum Kind { MISSING, FILE, DIRECTORY };
+
+	Kind kind = MISSING;
+	// on-disk path of the file; for a directory, of its index.html (if any)
+	std::string path;
+	uint64_t size = 0;
+	time_t mtime = 0;
+	std::string mime;
+	bool has_index = false;	// directories only: index.html is present
+};
+
+/**
+ * In-memory index of everything under the root directory, so requests are
+ * resolved with one walk down a path trie instead of stat calls.
+ *
+ * The trie is built at startup by several threads scanning directories in
+ * parallel and is then kept up to date by an inotify thread. Readers share
+ * a reader/writer lock with that thread.
+ *
+ * Only paths inside the root can be reached: ".." is refused, and symbolic
+ * links are indexed only if their target lies inside the root (requests
+ * through them are redirected to the target's own node).
+ */
+class SiteIndex {
+  public:
+	  // scans root with the given number of threads and starts watching it;
+	  // mime_type maps a file name to its Content-Type
+	  static void start(const std::string &root, int threads,
+			  std::function<std::string(const std::string&)> mime_type);
+
+	  // looks up a request path such as "/images/a.png" or "/docs/"
+	  static SiteEntry resolve(const std::string &request_path);
+
+	  // names in a directory, with "/" appended to subdirectories; false if
+	  // request_path is not a directory
+	  static bool list(const std::string &request_path, std::vector<std::string> &names);
+
+	  // opens the file an entry points at without following symbolic
+	  // links, so one swapped in since indexing can't lead out of the
+	  // root; -1 (errno set) if that fails or it is no longer a file
+	  static int openFile(const SiteEntry &entry);
+
+  private:
+	  struct Node {
+		  enum Kind { FILE, DIRECTORY, LINK };
+
+		  Kind kind = FILE;
+		  uint64_t size = 0;
+		  time_t mtime = 0;
+		  std::string mime;
+		  std::string link_target;	// LINK: root-relative path of the target
+		  bool has_index = false;
+		  std::map<std::string, std::unique_ptr<Node>> children;
+	  };
+
+	  struct ScanQueue;
+
+	  static std::unique_ptr<Node> build(int threads, size_t &entries);
+	  static void scanDirectory(const std::string &relative, Node &dir, ScanQueue *queue,
+			  size_t &entries);
+	  static std::unique_ptr<Node> makeNode(const std::string &relative,
+			  const std::string &name, int dir_fd, bool &is_dir);
+	  static void updateIndexFlag(Node &dir);
+	  static void watch(const std::string &relative);
+	  static void unwatch(const std::string &relative);
+
+	  static const Node *walk(const std::string &request_path, std::string &relative);
+	  static Node *findDirectory(const std::string &relative);
+
+	  static void watchLoop();
+	  static void rootRemoved();
+	  static void applyEvent(int wd, uint32_t mask, const std::string &name);
+
+	  static std::string root;
+	  static std::function<std::string(const std::string&)> mime_type;
+	  static std::unique_ptr<Node> tree;
+	  static std::shared_mutex tree_mutex;
+
+	  static int inotify_fd;
+	  // inotify watch descriptor -> root-relative directory ("" is the root)
+	  static std::unordered_map<int, std::string> watches;
+	  static std::mutex watches_mutex;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+
+/**
+ * Nearest-rank percentile of an already sorted, non-empty list (shared by
+ * the benchmark and replay tools).
+ *
+ * @param sorted The values in ascending order.
+ * @param p The percentile as a fraction, e.g. 0.99 for p99.
+ */
+inline double percentile(const std::vector<double> &sorted, double p) {
+	size_t rank = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(rank, sorted.size() - 1)];
+}
@@ -0,0 +1,291 @@
+/**
+ * Implementation of the Tls class.
+ * See the associated header file (Tls.hpp) for the declaration of this
+ * class.
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "Tls.hpp"
+
+// how long a client gets to finish the handshake
+static const int HANDSHAKE_TIMEOUT_MS = 10000;
+// largest piece of a file encrypted in user space at once (one TLS record)
+static const size_t RECORD_SIZE = 16384;
+
+SSL_CTX *Tls::context = nullptr;
+bool Tls::ktls_requested = false;
+SSL *Tls::sessions[Tls::MAX_TRACKED_FDS];
+
+/**
+ * Prints OpenSSL's error queue after a message and exits.
+ */
+static void fail(const char *what) {
+	std::cerr << what << "\n";
+	ERR_print_errors_fp(stderr);
+	exit(1);
+}
+
+/**
+ * Creates the server's TLS context.
+ *
+ * @param cert_file PEM certificate chain to present to clients.
+ * @param key_file PEM private key for the certificate.
+ * @param use_ktls Whether to ask OpenSSL to hand connections to kernel TLS.
+ */
+void Tls::start(const std::string &cert_file, const std::string &key_file,
+		bool use_ktls) {
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == nullptr) {
+		fail("Creating TLS context failed");
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file.c_str()) != 1) {
+		fail("Loading TLS certificate failed");
+	}
+	if (SSL_CTX_use_PrivateKey_file(ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1) {
+		fail("Loading TLS private key failed");
+	}
+	if (SSL_CTX_check_private_key(ctx) != 1) {
+		fail("TLS private key does not match the certificate");
+	}
+
+	/*
+	 * Session resumption: TLS 1.2 clients can resume from the server-side
+	 * session cache, TLS 1.3 clients from the (stateless) tickets OpenSSL
+	 * issues by default. Either way a returning client skips the expensive
+	 * public key operations.
+	 */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, 20000);
+	static const unsigned char session_context[] = "torero-serve";
+	SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+
+	// our sockets are non-blocking, so writes may be retried from a
+	// different buffer and may complete partially
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+			| SSL_MODE_ENABLE_PARTIAL_WRITE);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION);
+
+	if (use_ktls) {
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	}
+	ktls_requested = use_ktls;
+	context = ctx;
+}
+
+/**
+ * Gets the TLS state of a client socket (nullptr for plaintext sockets).
+ */
+SSL *Tls::session(int sock) {
+	if (sock < 0 || sock >= MAX_TRACKED_FDS) {
+		return nullptr;
+	}
+	return sessions[sock];
+}
+
+/**
+ * Runs the server side of the TLS handshake on a non-blocking socket.
+ *
+ * @param sock The freshly accepted client socket.
+ * @return True if the handshake completed; the socket may then be used
+ * with send(), recv() and sendFile().
+ */
+bool Tls::accept(int sock) {
+	if (sock < 0 || sock >= MAX_TRACKED_FDS) {
+		return false;
+	}
+	SSL *ssl = SSL_new(context);
+	if (ssl == nullptr || SSL_set_fd(ssl, sock) != 1) {
+		SSL_free(ssl);
+		return false;
+	}
+
+	while (true) {
+		ERR_clear_error();
+		int ret = SSL_accept(ssl);
+		if (ret == 1) {
+			break;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.revents = 0;
+		int error = SSL_get_error(ssl, ret);
+		if (error == SSL_ERROR_WANT_READ) {
+			pfd.events = POLLIN;
+		}
+		else if (error == SSL_ERROR_WANT_WRITE) {
+			pfd.events = POLLOUT;
+		}
+		else {
+			SSL_free(ssl);
+			return false;
+		}
+
+		int ready;
+		do {
+			ready = poll(&pfd, 1, HANDSHAKE_TIMEOUT_MS);
+		} while (ready < 0 && errno == EINTR);
+		if (ready <= 0) {
+			SSL_free(ssl);
+			return false;
+		}
+	}
+
+	// say once whether the kernel took over, since it depends on the
+	// kernel (the "tls" module), the OpenSSL build and the cipher
+	static std::atomic<bool> reported(false);
+	if (ktls_requested && !reported.exchange(true)) {
+		std::cerr << "kTLS send offload "
+			<< (BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "active" : "unavailable, encrypting in user space")
+			<< "\n";
+	}
+
+	sessions[sock] = ssl;
+	return true;
+}
+
+/**
+ * Sends close_notify if it can go out right away and frees the connection's
+ * TLS state. Safe to call on plaintext sockets.
+ *
+ * @param sock The client socket, about to be closed.
+ */
+void Tls::shutdown(int sock) {
+	SSL *ssl = session(sock);
+	if (ssl == nullptr) {
+		return;
+	}
+	ERR_clear_error();
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	sessions[sock] = nullptr;
+}
+
+/**
+ * Turns the return value of an SSL_* I/O call into send()/recv() style.
+ */
+ssize_t Tls::result(SSL *ssl, int ret, short &wait_for) {
+	if (ret > 0) {
+		return ret;
+	}
+	switch (SSL_get_error(ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			wait_for = POLLIN;
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_WANT_WRITE:
+			wait_for = POLLOUT;
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0) {
+				// peer vanished without close_notify
+				errno = ECONNRESET;
+			}
+			return -1;
+		default:
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+/**
+ * Sends plaintext bytes to a client, encrypting them if it uses TLS.
+ *
+ * @param wait_for Set to the poll() event to wait for when -1/EAGAIN is
+ * returned.
+ * @return Bytes sent, or -1 with errno set.
+ */
+ssize_t Tls::send(int sock, const char *data, size_t length, short &wait_for) {
+	SSL *ssl = session(sock);
+	if (ssl == nullptr) {
+		wait_for = POLLOUT;
+		return ::send(sock, data, length, MSG_NOSIGNAL);
+	}
+	ERR_clear_error();
+	errno = 0;
+	return result(ssl, SSL_write(ssl, data, static_cast<int>(length)), wait_for);
+}
+
+/**
+ * Receives plaintext bytes from a client, decrypting them if it uses TLS.
+ *
+ * @param wait_for Set to the poll() event to wait for when -1/EAGAIN is
+ * returned.
+ * @return Bytes received, 0 at end of stream, or -1 with errno set.
+ */
+ssize_t Tls::recv(int sock, char *dest, size_t length, short &wait_for) {
+	SSL *ssl = session(sock);
+	if (ssl == nullptr) {
+		wait_for = POLLIN;
+		return ::recv(sock, dest, length, 0);
+	}
+	ERR_clear_error();
+	errno = 0;
+	return result(ssl, SSL_read(ssl, dest, static_cast<int>(length)), wait_for);
+}
+
+/**
+ * Sends part of a file to a client. Plaintext and kTLS connections use
+ * sendfile() so the data never enters user space; other TLS connections
+ * read and encrypt one record at a time.
+ *
+ * @param file_fd The open file to send from.
+ * @param offset Where in the file to start.
+ * @param length Most bytes to send.
+ * @param wait_for Set to the poll() event to wait for when -1/EAGAIN is
+ * returned.
+ * @return Bytes sent, or -1 with errno set.
+ */
+ssize_t Tls::sendFile(int sock, int file_fd, off_t offset, size_t length,
+		short &wait_for) {
+	SSL *ssl = session(sock);
+	if (ssl == nullptr) {
+		wait_for = POLLOUT;
+		return ::sendfile(sock, file_fd, &offset, length);
+	}
+
+	ERR_clear_error();
+	errno = 0;
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+		ossl_ssize_t sent = SSL_sendfile(ssl, file_fd, offset, length, 0);
+		if (sent >= 0) {
+			return sent;
+		}
+		return result(ssl, -1, wait_for);
+	}
+
+	thread_local char record[RECORD_SIZE];
+	ssize_t got = pread(file_fd, record, std::min(length, RECORD_SIZE), offset);
+	if (got <= 0) {
+		return got;
+	}
+	return result(ssl, SSL_write(ssl, record, static_cast<int>(got)), wait_for);
+}
+
+/**
+ * Whether bytes written directly to the socket (write, splice, sendfile)
+ * reach the client correctly: true for plaintext sockets and for TLS
+ * connections the kernel encrypts.
+ */
+bool Tls::kernelSend(int sock) {
+	SSL *ssl = session(sock);
+	return ssl == nullptr || BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
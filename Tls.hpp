@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <sys/types.h>
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+
+/**
+ * TLS termination on top of OpenSSL, using kernel TLS (kTLS) when the kernel
+ * and OpenSSL both support it.
+ *
+ * Once a kTLS connection has finished its handshake the kernel does the
+ * record encryption, so files can still be handed to sendfile() and the
+ * proxy can still splice() into the socket. Without kTLS everything falls
+ * back to SSL_read/SSL_write in user space.
+ *
+ * send()/recv() work on plaintext sockets too, so callers can use them for
+ * every client connection. They never block: when they cannot make progress
+ * they return -1 with errno set to EAGAIN and tell the caller which poll()
+ * event to wait for.
+ */
+class Tls {
+  public:
+	  // loads the certificate and key; must be called before workers start
+	  static void start(const std::string &cert_file, const std::string &key_file,
+			  bool use_ktls);
+	  static bool enabled() { return context != nullptr; }
+
+	  // runs the server side of the handshake; false if it failed
+	  static bool accept(int sock);
+	  // sends close_notify (best effort) and frees the connection's state
+	  static void shutdown(int sock);
+
+	  static ssize_t send(int sock, const char *data, size_t length, short &wait_for);
+	  static ssize_t recv(int sock, char *dest, size_t length, short &wait_for);
+	  static ssize_t sendFile(int sock, int file_fd, off_t offset, size_t length,
+			  short &wait_for);
+
+	  // true if bytes written straight to the socket get encrypted (plaintext
+	  // connections and kTLS connections)
+	  static bool kernelSend(int sock);
+
+  private:
+	  static SSL *session(int sock);
+	  static ssize_t result(SSL *ssl, int ret, short &wait_for);
+
+	  static SSL_CTX *context;
+	  static bool ktls_requested;
+
+	  // TLS state of every client connection, indexed by socket descriptor
+	  static const int MAX_TRACKED_FDS = 65536;
+	  static SSL *sessions[MAX_TRACKED_FDS];
+};
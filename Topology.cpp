@@ -0,0 +1,162 @@
+/**
+ * Implementation of the Topology class.
+ * See the associated header file (Topology.hpp) for the declaration of this
+ * class.
+ */
+#include <cerrno>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "Topology.hpp"
+
+using std::string;
+using std::vector;
+
+static const string CPU_DIR("/sys/devices/system/cpu/");
+static const string NODE_DIR("/sys/devices/system/node/");
+
+/**
+ * Reads the allowed CPUs and their core, package and node from sysfs.
+ */
+vector<CpuInfo> Topology::discover() {
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		return vector<CpuInfo>();
+	}
+
+	// which node each CPU belongs to, from the node cpulists
+	std::map<int, int> node_of;
+	vector<int> nodes = parseCpuList(readLine(NODE_DIR + "online"));
+	for (int node : nodes) {
+		string list = readLine(NODE_DIR + "node" + std::to_string(node) + "/cpulist");
+		for (int cpu : parseCpuList(list)) {
+			node_of[cpu] = node;
+		}
+	}
+
+	vector<CpuInfo> cpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &allowed)) {
+			continue;
+		}
+		string topology = CPU_DIR + "cpu" + std::to_string(cpu) + "/topology/";
+		CpuInfo info;
+		info.cpu = cpu;
+		info.core = readInt(topology + "core_id", cpu);
+		info.package = readInt(topology + "physical_package_id", 0);
+		info.node = node_of.count(cpu) ? node_of[cpu] : 0;
+		cpus.push_back(info);
+	}
+
+	/*
+	 * Order by node, then put the first hardware thread of every physical
+	 * core ahead of the SMT siblings, so that using the first N entries
+	 * spreads work over real cores before doubling up on one.
+	 */
+	std::set<std::pair<int, int>> seen_cores;
+	vector<CpuInfo> first, siblings;
+	std::stable_sort(cpus.begin(), cpus.end(), [](const CpuInfo &a, const CpuInfo &b) {
+		return a.node < b.node;
+	});
+	for (const CpuInfo &info : cpus) {
+		if (seen_cores.insert(std::make_pair(info.package, info.core)).second) {
+			first.push_back(info);
+		}
+		else {
+			siblings.push_back(info);
+		}
+	}
+	first.insert(first.end(), siblings.begin(), siblings.end());
+	return first;
+}
+
+/**
+ * Binds the calling thread to a single CPU.
+ *
+ * @param cpu The logical CPU number.
+ * @return False if the kernel refused.
+ */
+bool Topology::pinThread(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err != 0) {
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Counts the NUMA nodes that the given CPUs span.
+ */
+int Topology::countNodes(const vector<CpuInfo> &cpus) {
+	std::set<int> nodes;
+	for (const CpuInfo &info : cpus) {
+		nodes.insert(info.node);
+	}
+	return nodes.size();
+}
+
+/**
+ * Parses the kernel's CPU list format ("0-3,8,10-11"). Malformed pieces are
+ * skipped.
+ *
+ * @param list The text of a cpulist file.
+ * @return The listed numbers in order.
+ */
+vector<int> Topology::parseCpuList(const string &list) {
+	vector<int> result;
+	size_t pos = 0;
+	while (pos < list.size()) {
+		size_t end = list.find(',', pos);
+		if (end == string::npos) {
+			end = list.size();
+		}
+		string piece = list.substr(pos, end - pos);
+		pos = end + 1;
+
+		size_t dash = piece.find('-');
+		try {
+			int low = std::stoi(piece.substr(0, dash));
+			int high = (dash == string::npos) ? low : std::stoi(piece.substr(dash + 1));
+			for (int i = low; i <= high; ++i) {
+				result.push_back(i);
+			}
+		}
+		catch (const std::exception &) {
+			continue;
+		}
+	}
+	return result;
+}
+
+/**
+ * Reads a sysfs file holding one number.
+ */
+int Topology::readInt(const string &path, int fallback) {
+	string line = readLine(path);
+	try {
+		return line.empty() ? fallback : std::stoi(line);
+	}
+	catch (const std::exception &) {
+		return fallback;
+	}
+}
+
+/**
+ * Reads the first line of a sysfs file ("" if it does not exist).
+ */
+string Topology::readLine(const string &path) {
+	std::ifstream file(path);
+	string line;
+	std::getline(file, line);
+	return line;
+}
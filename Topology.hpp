@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+
+/**
+ * One logical CPU and where it sits in the machine.
+ */
+struct CpuInfo {
+	int cpu;		// logical CPU number (as used by sched_setaffinity)
+	int core;		// physical core id, unique within the package
+	int package;	// physical package (socket) id
+	int node;		// NUMA node, 0 on machines without NUMA
+};
+
+/**
+ * CPU and NUMA layout of the machine, read from sysfs.
+ *
+ * Only CPUs the process is allowed to run on are reported (so taskset and
+ * cgroup cpusets are respected). Without sysfs every allowed CPU is treated
+ * as its own core on node 0.
+ */
+class Topology {
+  public:
+	  // allowed CPUs ordered for placing workers: node by node, one hardware
+	  // thread per physical core first, then their SMT siblings
+	  static std::vector<CpuInfo> discover();
+
+	  // binds the calling thread to one CPU; false (with errno set) on failure
+	  static bool pinThread(int cpu);
+
+	  // number of distinct NUMA nodes among cpus
+	  static int countNodes(const std::vector<CpuInfo> &cpus);
+
+	  // parses a sysfs CPU list such as "0-3,8,10-11"
+	  static std::vector<int> parseCpuList(const std::string &list);
+
+  private:
+	  static int readInt(const std::string &path, int fallback);
+	  static std::string readLine(const std::string &path);
+};
@@ -0,0 +1,252 @@
+/**
+ * Implementation of the Tracer class.
+ * See the associated header file (Tracer.hpp) for the declaration of this
+ * class.
+ */
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <unistd.h>
+
+#include "Tracer.hpp"
+
+// once a thread has this much rendered JSON it hands it to the output file
+static const size_t FLUSH_THRESHOLD = 64 * 1024;
+
+bool Tracer::active = false;
+bool Tracer::accepts_recorded = false;
+int Tracer::sample_every = 1;
+uint64_t Tracer::slow_us = 0;
+std::atomic<uint64_t> Tracer::request_count(0);
+std::atomic<int> Tracer::next_tid(1);
+std::atomic<uint64_t> Tracer::accepted_at[Tracer::MAX_TRACKED_FDS];
+std::mutex Tracer::out_lock;
+std::ofstream Tracer::out;
+bool Tracer::first_event = true;
+std::vector<Tracer::ThreadLog*> Tracer::logs;
+
+/**
+ * Escapes a string so it can be placed between quotes in JSON.
+ */
+static std::string jsonEscape(const std::string &s) {
+	std::string escaped;
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+			escaped += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20) {
+			char hex[8];
+			snprintf(hex, sizeof(hex), "\\u%04x", c);
+			escaped += hex;
+		}
+		else {
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+/**
+ * Opens the trace file and turns tracing on.
+ *
+ * @param path Where to write the Chrome Trace Event JSON.
+ * @param every Keep the spans of one out of every this many requests.
+ * @param slow_ms Requests slower than this (in ms) are always kept and
+ * reported on stderr. Zero disables the check.
+ */
+void Tracer::start(const std::string &path, int every, double slow_ms) {
+	out.open(path, std::ios::trunc);
+	if (!out) {
+		perror("Opening trace file failed");
+		exit(1);
+	}
+	out << "[\n";
+
+	sample_every = (every < 1) ? 1 : every;
+	slow_us = static_cast<uint64_t>(slow_ms * 1000.0);
+	active = true;
+	accepts_recorded = true;
+}
+
+/**
+ * Current time in microseconds, the unit used by the trace format.
+ */
+uint64_t Tracer::now() {
+	using namespace std::chrono;
+	return duration_cast<microseconds>(
+			steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Gets the calling thread's log, creating and registering it on first use.
+ */
+Tracer::ThreadLog &Tracer::local() {
+	thread_local ThreadLog *log = nullptr;
+	if (log == nullptr) {
+		log = new ThreadLog();
+		log->tid = next_tid++;
+
+		std::lock_guard<std::mutex> guard(out_lock);
+		logs.push_back(log);
+	}
+	return *log;
+}
+
+/**
+ * Remembers when a socket was accepted so the time it spends waiting in the
+ * BoundedBuffer shows up as a "queue" span.
+ *
+ * @param sock The newly accepted client socket.
+ */
+void Tracer::noteAccepted(int sock) {
+	if (!accepts_recorded || sock < 0 || sock >= MAX_TRACKED_FDS) {
+		return;
+	}
+	accepted_at[sock].store(now(), std::memory_order_relaxed);
+}
+
+/**
+ * Marks the start of a request on the calling thread.
+ *
+ * @param sock The client socket the worker just took from the buffer.
+ * @return When sock was accepted (Tracer::now() time), or 0 if that was not
+ * recorded.
+ */
+uint64_t Tracer::beginRequest(int sock) {
+	uint64_t accepted = 0;
+	if (accepts_recorded && sock >= 0 && sock < MAX_TRACKED_FDS) {
+		// cleared now, while the fd is certainly still ours; once the
+		// request closes it the number may be handed to a new connection
+		accepted = accepted_at[sock].exchange(0, std::memory_order_relaxed);
+	}
+	if (!active) {
+		return accepted;
+	}
+	ThreadLog &log = local();
+	log.pending.clear();
+	log.request_sock = sock;
+
+	uint64_t picked_up = now();
+	log.request_start = picked_up;
+	if (accepted != 0 && accepted <= picked_up) {
+		log.request_start = accepted;
+		record("queue", accepted, picked_up);
+	}
+	return accepted;
+}
+
+/**
+ * Records a finished stage of the current request.
+ */
+void Tracer::record(const char *name, uint64_t start_us, uint64_t end_us) {
+	local().pending.push_back({name, start_us, end_us - start_us});
+}
+
+/**
+ * Appends one complete ("X") event to the thread's rendered JSON.
+ */
+void Tracer::render(ThreadLog &log, const Event &e, const std::string &args) {
+	log.json += "{\"name\":\"";
+	log.json += e.name;
+	log.json += "\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":";
+	log.json += std::to_string(getpid());
+	log.json += ",\"tid\":";
+	log.json += std::to_string(log.tid);
+	log.json += ",\"ts\":";
+	log.json += std::to_string(e.ts);
+	log.json += ",\"dur\":";
+	log.json += std::to_string(e.dur);
+	if (!args.empty()) {
+		log.json += ",\"args\":{" + args + "}";
+	}
+	log.json += "},\n";
+}
+
+/**
+ * Marks the end of the current request. Its spans are kept if the request
+ * was sampled or took longer than the slow threshold, and dropped otherwise.
+ *
+ * @param object The requested path, used to label the request span.
+ */
+void Tracer::endRequest(const std::string &object) {
+	if (!active) {
+		return;
+	}
+	ThreadLog &log = local();
+	uint64_t finished = now();
+	uint64_t total = finished - log.request_start;
+
+	bool sampled = (request_count++ % sample_every) == 0;
+	bool slow = (slow_us != 0) && (total > slow_us);
+	if (slow) {
+		std::cerr << "slow request: " << object << " took "
+			<< (total / 1000.0) << " ms\n";
+	}
+
+	if (sampled || slow) {
+		std::lock_guard<std::mutex> guard(log.lock);
+		std::string args = "\"object\":\"" + jsonEscape(object) + "\""
+			+ ",\"sock\":" + std::to_string(log.request_sock)
+			+ ",\"slow\":" + (slow ? "true" : "false");
+		render(log, {"request", log.request_start, total}, args);
+		for (const Event &e : log.pending) {
+			render(log, e, "");
+		}
+		if (slow) {
+			log.json += "{\"name\":\"slow request\",\"cat\":\"http\",\"ph\":\"i\",\"s\":\"t\",\"pid\":"
+				+ std::to_string(getpid()) + ",\"tid\":" + std::to_string(log.tid)
+				+ ",\"ts\":" + std::to_string(finished) + "},\n";
+		}
+		if (log.json.size() >= FLUSH_THRESHOLD) {
+			flush(log);
+		}
+	}
+	log.pending.clear();
+}
+
+/**
+ * Hands a thread's rendered events to the output file. The caller must hold
+ * the thread's lock.
+ */
+void Tracer::flush(ThreadLog &log) {
+	if (log.json.empty()) {
+		return;
+	}
+	std::lock_guard<std::mutex> guard(out_lock);
+	if (first_event) {
+		// name the process once so the viewer shows something useful
+		out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << getpid()
+			<< ",\"args\":{\"name\":\"torero-serve\"}},\n";
+		first_event = false;
+	}
+	out << log.json;
+	out.flush();
+	log.json.clear();
+}
+
+/**
+ * Writes out whatever every thread still has buffered and terminates the
+ * JSON array. Meant to be called once, on shutdown.
+ */
+void Tracer::finish() {
+	if (!active) {
+		return;
+	}
+	std::vector<ThreadLog*> snapshot;
+	{
+		std::lock_guard<std::mutex> guard(out_lock);
+		snapshot = logs;
+	}
+	for (ThreadLog *log : snapshot) {
+		std::lock_guard<std::mutex> guard(log->lock);
+		flush(*log);
+	}
+
+	std::lock_guard<std::mutex> guard(out_lock);
+	// every event above ends with a comma, so close with a harmless metadata
+	// event to keep the file valid JSON
+	out << "{\"name\":\"trace_end\",\"ph\":\"M\",\"pid\":" << getpid()
+		<< ",\"args\":{}}\n]\n";
+	out.close();
+}
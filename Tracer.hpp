@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+/**
+ * Opt-in request tracer that writes Chrome Trace Event JSON.
+ *
+ * Each worker thread records the stages of the request it is handling (queue
+ * wait, recv, parsing, filesystem lookups, sending) into its own buffer. When
+ * the request finishes the spans are either kept (the request was sampled or
+ * was slower than the threshold) or thrown away. Kept spans are written out
+ * in batches so the hot path never touches the shared output file.
+ *
+ * The output can be loaded into chrome://tracing or https://ui.perfetto.dev.
+ */
+class Tracer {
+  public:
+	  // turns tracing on; must be called before any worker threads start
+	  static void start(const std::string &path, int sample_every, double slow_ms);
+	  static bool enabled() { return active; }
+
+	  // request lifecycle, called by the accept loop and the workers;
+	  // beginRequest returns when sock was accepted (0 if not recorded)
+	  static void noteAccepted(int sock);
+	  static uint64_t beginRequest(int sock);
+	  // records accept times even with tracing off (the capture needs them)
+	  static void recordAccepts() { accepts_recorded = true; }
+	  static void endRequest(const std::string &object);
+
+	  // records one finished stage for the current request
+	  static void record(const char *name, uint64_t start_us, uint64_t end_us);
+	  static uint64_t now();
+
+	  // writes out every thread's remaining events and closes the JSON array
+	  static void finish();
+
+  private:
+	  struct Event {
+		  const char *name;
+		  uint64_t ts;
+		  uint64_t dur;
+	  };
+
+	  // one per worker thread; the mutex is only contended by finish()
+	  struct ThreadLog {
+		  int tid;
+		  std::mutex lock;
+		  std::vector<Event> pending; // spans of the request in progress
+		  std::string json;           // spans of sampled/slow requests
+		  uint64_t request_start = 0;
+		  int request_sock = -1;
+	  };
+
+	  static ThreadLog &local();
+	  static void render(ThreadLog &log, const Event &e, const std::string &args);
+	  static void flush(ThreadLog &log);
+
+	  static bool active;
+	  static bool accepts_recorded;
+	  static int sample_every;
+	  static uint64_t slow_us;
+	  static std::atomic<uint64_t> request_count;
+	  static std::atomic<int> next_tid;
+
+	  // accept timestamps indexed by socket descriptor (for the queue span)
+	  static const int MAX_TRACKED_FDS = 65536;
+	  static std::atomic<uint64_t> accepted_at[MAX_TRACKED_FDS];
+
+	  static std::mutex out_lock;
+	  static std::ofstream out;
+	  static bool first_event;
+	  static std::vector<ThreadLog*> logs;
+};
+
+/**
+ * Times the enclosing scope and records it as a span of the current request.
+ * Costs a single branch when tracing is off.
+ */
+class TraceSpan {
+  public:
+	  TraceSpan(const char *span_name) : name(span_name) {
+		  if (Tracer::enabled()) {
+			  start = Tracer::now();
+		  }
+	  }
+
+	  ~TraceSpan() {
+		  if (Tracer::enabled()) {
+			  Tracer::record(name, start, Tracer::now());
+		  }
+	  }
+
+  private:
+	  const char *name;
+	  uint64_t start = 0;
+};
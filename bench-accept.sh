@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Runs torero-accept-bench against torero-serve once per accept-path option
+# set, so their effect on connection latency and accept throughput can be
+# compared side by side.
+#
+# Usage: ./bench-accept.sh [port] [connections] [concurrency]
+#
+# TCP_FASTOPEN only takes effect on the server side when the
+# net.ipv4.tcp_fastopen sysctl has bit 2 set (e.g. "sysctl -w
+# net.ipv4.tcp_fastopen=3"); otherwise that row measures a normal handshake.
+
+PORT=${1:-7199}
+CONNECTIONS=${2:-5000}
+CONCURRENCY=${3:-16}
+
+run() {
+	label=$1
+	server_flags=$2
+	client_flags=$3
+
+	./torero-serve "$PORT" WWW --backlog 1024 $server_flags &
+	server=$!
+	sleep 0.3
+
+	echo "== $label (server: ${server_flags:-defaults}${client_flags:+, client: $client_flags})"
+	./torero-accept-bench "$PORT" --connections "$CONNECTIONS" \
+		--concurrency "$CONCURRENCY" $client_flags
+
+	kill -INT "$server"
+	wait "$server" 2>/dev/null
+	echo
+}
+
+run "baseline (one accept per wakeup)" "--accept-batch 1"
+run "accept4 batching" "--accept-batch 64"
+run "TCP_DEFER_ACCEPT" "--accept-batch 64 --defer-accept 5"
+run "TCP_NODELAY" "--accept-batch 64 --nodelay"
+run "socket buffers" "--accept-batch 64 --sndbuf 262144 --rcvbuf 262144"
+run "TCP_FASTOPEN" "--accept-batch 64 --fastopen 256" "--fastopen"
+run "everything" "--accept-batch 64 --defer-accept 5 --nodelay --fastopen 256" "--fastopen"
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Measures how torero-serve's per-core mode scales: runs torero-accept-bench
+# against --per-core 1, 2, ... up to every CPU and prints one throughput line
+# per core count, followed by the shared-queue mode for comparison.
+#
+# Usage: ./bench-scale.sh [port] [connections] [concurrency]
+#
+# The benchmark client runs on the same machine and competes with the server
+# for CPUs, so the top of the curve flattens earlier than it would with the
+# client on a separate host.
+
+PORT=${1:-7299}
+CONNECTIONS=${2:-20000}
+CONCURRENCY=${3:-64}
+MAX_CORES=$(nproc)
+
+run() {
+	label=$1
+	server_flags=$2
+
+	./torero-serve "$PORT" WWW --backlog 1024 --accept-batch 64 $server_flags > /dev/null &
+	server=$!
+	sleep 0.3
+
+	result=$(./torero-accept-bench "$PORT" --connections "$CONNECTIONS" \
+		--concurrency "$CONCURRENCY" | grep throughput)
+	echo "$label: ${result#*throughput: }"
+
+	kill -INT "$server"
+	wait "$server" 2>/dev/null
+}
+
+cores=1
+while [ "$cores" -le "$MAX_CORES" ]; do
+	run "per-core, $cores core(s)" "--per-core $cores"
+	cores=$((cores + 1))
+done
+run "shared queue, unpinned" ""
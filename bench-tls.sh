@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Compares TLS handshake rate and bulk throughput of torero-serve with and
+# without kernel TLS offload. Uses a throwaway self-signed certificate and a
+# scratch root directory holding a copy of WWW plus one large file.
+#
+# Usage: ./bench-tls.sh [port] [bulk file size in MiB]
+#
+# kTLS needs the kernel "tls" module (modprobe tls); without it both runs
+# encrypt in user space and torero-serve says so on startup.
+
+PORT=${1:-7443}
+SIZE_MB=${2:-64}
+
+SCRATCH=$(mktemp -d)
+trap 'rm -rf "$SCRATCH"' EXIT
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+	-keyout "$SCRATCH/key.pem" -out "$SCRATCH/cert.pem" 2>/dev/null || exit 1
+cp -r WWW "$SCRATCH/root"
+head -c "$((SIZE_MB * 1024 * 1024))" /dev/urandom > "$SCRATCH/root/big.txt"
+
+run() {
+	label=$1
+	server_flags=$2
+
+	./torero-serve "$PORT" "$SCRATCH/root" --tls-cert "$SCRATCH/cert.pem" \
+		--tls-key "$SCRATCH/key.pem" --backlog 1024 $server_flags &
+	server=$!
+	sleep 0.3
+
+	echo "== $label"
+	./torero-tls-bench "$PORT" --bulk-path /big.txt
+
+	kill -INT "$server"
+	wait "$server" 2>/dev/null
+	echo
+}
+
+run "kTLS requested" ""
+run "user-space TLS" "--no-ktls"
@@ -0,0 +1,223 @@
+/**
+ * torero-accept-bench: measures connection establishment latency and accept
+ * throughput of a running torero-serve.
+ *
+ * Every connection connects, sends one small GET request, and reads the
+ * response until the server closes. The time until connect() returns (the
+ * handshake) and the time until the response is complete are recorded
+ * separately.
+ *
+ * Usage: ./torero-accept-bench (port #) [options]
+ * 	--host ADDR			IPv4 address of the server (default 127.0.0.1)
+ * 	--connections N		total connections to make (default 5000)
+ * 	--concurrency N		connections in flight at once (default 16)
+ * 	--path PATH			object to request (default /index.html)
+ * 	--fastopen			send the request in the SYN (MSG_FASTOPEN)
+ */
+
+// standard C libraries
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+// operating system specific libraries
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// C++ standard libraries
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Stats.hpp"
+
+using std::cout;
+using std::string;
+using std::vector;
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Timings for one connection, in milliseconds.
+ */
+struct Sample {
+	bool ok = false;
+	double connect_ms = 0;
+	double total_ms = 0;
+};
+
+Sample runConnection(const struct sockaddr_in &addr, const string &request,
+		bool fastopen);
+void report(const string &label, vector<double> values);
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cout << "INCORRECT USAGE!\n";
+		cout << "Proper Format: ./torero-accept-bench (port #) [--host ADDR] [--connections N] [--concurrency N] [--path PATH] [--fastopen]\n";
+		cout << "Example: ./torero-accept-bench 7101 --connections 20000 --concurrency 32\n";
+		exit(1);
+	}
+
+	int port = std::stoi(argv[1]);
+	string host("127.0.0.1");
+	int connections = 5000;
+	int concurrency = 16;
+	string path("/index.html");
+	bool fastopen = false;
+
+	for (int i = 2; i < argc; ++i) {
+		string flag(argv[i]);
+		if (flag == "--fastopen") {
+			fastopen = true;
+			continue;
+		}
+		if (i + 1 >= argc) {
+			cout << "Missing value for " << flag << "\n";
+			exit(1);
+		}
+		string value(argv[++i]);
+		if (flag == "--host") {
+			host = value;
+		}
+		else if (flag == "--connections") {
+			connections = std::max(1, std::stoi(value));
+		}
+		else if (flag == "--concurrency") {
+			concurrency = std::max(1, std::stoi(value));
+		}
+		else if (flag == "--path") {
+			path = value;
+		}
+		else {
+			cout << "Unknown option: " << flag << "\n";
+			exit(1);
+		}
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+		std::cerr << "Bad host address: " << host << "\n";
+		exit(1);
+	}
+	string request("GET " + path + " HTTP/1.0\r\n\r\n");
+
+	vector<Sample> samples(connections);
+	std::atomic<int> next(0);
+	Clock::time_point start = Clock::now();
+
+	vector<std::thread> clients;
+	for (int i = 0; i < concurrency; ++i) {
+		clients.emplace_back([&]() {
+			int index;
+			while ((index = next++) < connections) {
+				samples[index] = runConnection(addr, request, fastopen);
+			}
+		});
+	}
+	for (std::thread &t : clients) {
+		t.join();
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+	vector<double> connect_times, total_times;
+	int failures = 0;
+	for (const Sample &s : samples) {
+		if (!s.ok) {
+			failures++;
+			continue;
+		}
+		connect_times.push_back(s.connect_ms);
+		total_times.push_back(s.total_ms);
+	}
+
+	cout << "connections: " << connections << "  failed: " << failures
+		<< "  elapsed: " << elapsed << " s  throughput: "
+		<< (connections - failures) / elapsed << " conn/s\n";
+	report("connect ms ", connect_times);
+	report("response ms", total_times);
+
+	return failures == 0 ? 0 : 2;
+}
+
+/**
+ * Makes one connection, sends the request, and reads the whole response.
+ */
+Sample runConnection(const struct sockaddr_in &addr, const string &request,
+		bool fastopen) {
+	Sample sample;
+	Clock::time_point began = Clock::now();
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("Creating socket failed");
+		return sample;
+	}
+
+	size_t sent = 0;
+	if (fastopen) {
+		// connects and queues the request in one call; with a cached cookie
+		// the data rides along in the SYN
+		ssize_t n = sendto(sock, request.data(), request.size(),
+				MSG_FASTOPEN | MSG_NOSIGNAL, (const struct sockaddr*)&addr,
+				sizeof(addr));
+		if (n < 0) {
+			close(sock);
+			return sample;
+		}
+		sent = n;
+	}
+	else if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return sample;
+	}
+	sample.connect_ms = std::chrono::duration<double, std::milli>(
+			Clock::now() - began).count();
+
+	while (sent < request.size()) {
+		ssize_t n = send(sock, request.data() + sent, request.size() - sent,
+				MSG_NOSIGNAL);
+		if (n <= 0) {
+			close(sock);
+			return sample;
+		}
+		sent += n;
+	}
+
+	char buffer[16384];
+	size_t received = 0;
+	ssize_t n;
+	while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+		received += n;
+	}
+	close(sock);
+
+	sample.total_ms = std::chrono::duration<double, std::milli>(
+			Clock::now() - began).count();
+	sample.ok = received > 0;
+	return sample;
+}
+
+/**
+ * Prints the distribution of one set of timings.
+ */
+void report(const string &label, vector<double> values) {
+	if (values.empty()) {
+		return;
+	}
+	std::sort(values.begin(), values.end());
+	cout << label << ": p50 " << percentile(values, 0.50)
+		<< "  p90 " << percentile(values, 0.90)
+		<< "  p99 " << percentile(values, 0.99)
+		<< "  max " << values.back() << "\n";
+}
@@ -0,0 +1,380 @@
+/**
+ * torero-h2-client: a minimal cleartext HTTP/2 client for checking
+ * torero-serve's h2c support offline. All paths are requested at once on
+ * one connection (streams 1, 3, 5, ...) and the responses are read back as
+ * the server interleaves them.
+ *
+ * Usage: ./torero-h2-client (port #) [options] PATH...
+ * 	--host ADDR		IPv4 address of the server (default 127.0.0.1)
+ * 	--upgrade		start with HTTP/1.1 "Upgrade: h2c" instead of prior
+ * 					knowledge (the first path rides on the upgrade request)
+ * 	--window N		per-stream flow control window we advertise; small
+ * 					values make the server interleave more finely
+ * 	--root DIR		compare each 200 response body with DIR + path
+ *
+ * Exits non-zero if any stream fails or (with --root) a body differs.
+ */
+
+// standard C libraries
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// operating system specific libraries
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// C++ standard libraries
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Hpack.hpp"
+#include "Http2Frame.hpp"
+
+using std::cout;
+using std::string;
+using std::vector;
+
+/**
+ * What came back on one stream.
+ */
+struct StreamResult {
+	string path;
+	string status;
+	string content_type;
+	string body;
+	int data_frames = 0;
+	bool done = false;
+};
+
+void sendAll(int sock, const string &data);
+bool readFrame(int sock, string &buffer, uint8_t &type, uint8_t &flags,
+		uint32_t &stream_id, string &payload);
+string settingsPayload(uint32_t window);
+string base64UrlEncode(const string &in);
+string readFile(const string &path, bool &found);
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		cout << "INCORRECT USAGE!\n";
+		cout << "Proper Format: ./torero-h2-client (port #) [--host ADDR] [--upgrade] [--window N] [--root DIR] PATH...\n";
+		cout << "Example: ./torero-h2-client 7099 --root WWW / /comp375.css /tux.png\n";
+		exit(1);
+	}
+
+	int port = std::stoi(argv[1]);
+	string host("127.0.0.1");
+	bool upgrade = false;
+	uint32_t window = http2::DEFAULT_WINDOW;
+	string root;
+	vector<string> paths;
+
+	for (int i = 2; i < argc; ++i) {
+		string arg(argv[i]);
+		if (arg == "--upgrade") {
+			upgrade = true;
+		}
+		else if ((arg == "--host" || arg == "--window" || arg == "--root") && i + 1 < argc) {
+			string value(argv[++i]);
+			if (arg == "--host") {
+				host = value;
+			}
+			else if (arg == "--window") {
+				window = std::max(1, std::stoi(value));
+			}
+			else {
+				root = value;
+			}
+		}
+		else if (!arg.empty() && arg[0] == '/') {
+			paths.push_back(arg);
+		}
+		else {
+			cout << "Unknown option: " << arg << "\n";
+			exit(1);
+		}
+	}
+	if (paths.empty()) {
+		cout << "No paths to request\n";
+		exit(1);
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+		std::cerr << "Bad host address: " << host << "\n";
+		exit(1);
+	}
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0 || connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	std::map<uint32_t, StreamResult> streams;
+	string buffer;
+	uint32_t next_stream = 1;
+
+	if (upgrade) {
+		// the first path goes out as an HTTP/1.1 request and becomes stream 1
+		string request("GET " + paths[0] + " HTTP/1.1\r\nHost: " + host
+				+ "\r\nConnection: Upgrade, HTTP2-Settings\r\nUpgrade: h2c\r\n"
+				+ "HTTP2-Settings: " + base64UrlEncode(settingsPayload(window)) + "\r\n\r\n");
+		sendAll(sock, request);
+
+		char chunk[4096];
+		while (buffer.find("\r\n\r\n") == string::npos) {
+			ssize_t n = recv(sock, chunk, sizeof(chunk), 0);
+			if (n <= 0) {
+				std::cerr << "connection closed during upgrade\n";
+				exit(1);
+			}
+			buffer.append(chunk, n);
+		}
+		size_t end = buffer.find("\r\n\r\n");
+		string status_line = buffer.substr(0, buffer.find("\r\n"));
+		if (status_line.find(" 101 ") == string::npos) {
+			std::cerr << "upgrade refused: " << status_line << "\n";
+			exit(1);
+		}
+		buffer.erase(0, end + 4);
+		streams[1].path = paths[0];
+		next_stream = 3;
+	}
+
+	// an upgraded connection still has to send the preface and a SETTINGS
+	// frame of its own
+	string out(http2::PREFACE);
+	http2::appendFrame(out, http2::SETTINGS, 0, 0, settingsPayload(window));
+
+	HpackEncoder encoder;
+	for (size_t i = upgrade ? 1 : 0; i < paths.size(); ++i) {
+		vector<Header> headers;
+		headers.push_back(Header(":method", "GET"));
+		headers.push_back(Header(":scheme", "http"));
+		headers.push_back(Header(":authority", host));
+		headers.push_back(Header(":path", paths[i]));
+		http2::appendFrame(out, http2::HEADERS, http2::END_HEADERS | http2::END_STREAM,
+				next_stream, encoder.encode(headers));
+		streams[next_stream].path = paths[i];
+		next_stream += 2;
+	}
+	sendAll(sock, out);
+
+	HpackDecoder decoder(4096);
+	size_t remaining = streams.size();
+	int interleavings = 0;
+	uint32_t last_data_stream = 0;
+	string header_block;
+
+	while (remaining > 0) {
+		uint8_t type, flags;
+		uint32_t stream_id;
+		string payload;
+		if (!readFrame(sock, buffer, type, flags, stream_id, payload)) {
+			std::cerr << "connection closed with " << remaining << " stream(s) unfinished\n";
+			break;
+		}
+
+		bool end_stream = false;
+		if (type == http2::SETTINGS && !(flags & http2::ACK)) {
+			string ack;
+			http2::appendFrame(ack, http2::SETTINGS, http2::ACK, 0, "");
+			sendAll(sock, ack);
+		}
+		else if (type == http2::HEADERS || type == http2::CONTINUATION) {
+			header_block += payload;
+			if (type == http2::HEADERS) {
+				end_stream = flags & http2::END_STREAM;
+			}
+			if (flags & http2::END_HEADERS) {
+				vector<Header> headers;
+				if (!decoder.decode(reinterpret_cast<const uint8_t*>(header_block.data()),
+							header_block.size(), headers)) {
+					std::cerr << "HPACK decoding failed\n";
+					exit(1);
+				}
+				header_block.clear();
+				for (const Header &h : headers) {
+					if (h.first == ":status") {
+						streams[stream_id].status = h.second;
+					}
+					else if (h.first == "content-type") {
+						streams[stream_id].content_type = h.second;
+					}
+				}
+			}
+		}
+		else if (type == http2::DATA) {
+			StreamResult &result = streams[stream_id];
+			result.body += payload;
+			result.data_frames++;
+			end_stream = flags & http2::END_STREAM;
+			if (last_data_stream != 0 && last_data_stream != stream_id) {
+				interleavings++;
+			}
+			last_data_stream = stream_id;
+
+			// give the credit straight back so the transfer keeps going
+			if (!payload.empty()) {
+				string increment, update;
+				http2::appendUint32(increment, payload.size());
+				http2::appendFrame(update, http2::WINDOW_UPDATE, 0, 0, increment);
+				if (!end_stream) {
+					http2::appendFrame(update, http2::WINDOW_UPDATE, 0, stream_id, increment);
+				}
+				sendAll(sock, update);
+			}
+		}
+		else if (type == http2::RST_STREAM) {
+			streams[stream_id].status = "reset";
+			end_stream = true;
+		}
+		else if (type == http2::GOAWAY) {
+			std::cerr << "server sent GOAWAY\n";
+			break;
+		}
+
+		if (end_stream && streams.count(stream_id) && !streams[stream_id].done) {
+			streams[stream_id].done = true;
+			remaining--;
+		}
+	}
+
+	string goaway;
+	string goaway_payload;
+	http2::appendUint32(goaway_payload, 0);
+	http2::appendUint32(goaway_payload, http2::NO_ERROR);
+	http2::appendFrame(goaway, http2::GOAWAY, 0, 0, goaway_payload);
+	sendAll(sock, goaway);
+	close(sock);
+
+	bool ok = remaining == 0;
+	for (auto &entry : streams) {
+		StreamResult &result = entry.second;
+		cout << "stream " << entry.first << "  " << result.path << "  status "
+			<< (result.status.empty() ? "-" : result.status) << "  "
+			<< result.body.size() << " bytes in " << result.data_frames
+			<< " DATA frame(s)";
+		if (!root.empty() && result.status == "200") {
+			bool found;
+			string expected = readFile(root + result.path, found);
+			// a generated directory listing has no file to compare with
+			if (found) {
+				bool match = expected == result.body;
+				cout << (match ? "  body ok" : "  BODY MISMATCH");
+				ok = ok && match;
+			}
+		}
+		if (!result.done || result.status.empty() || result.status == "reset") {
+			ok = false;
+		}
+		cout << "\n";
+	}
+	cout << "interleavings: " << interleavings << "\n";
+	return ok ? 0 : 1;
+}
+
+/**
+ * Writes all of data to the (blocking) socket, exiting on failure.
+ */
+void sendAll(int sock, const string &data) {
+	size_t sent = 0;
+	while (sent < data.size()) {
+		ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0) {
+			perror("send");
+			exit(1);
+		}
+		sent += n;
+	}
+}
+
+/**
+ * Reads the next frame, using buffer for bytes that arrived early.
+ *
+ * @return False if the connection closed first.
+ */
+bool readFrame(int sock, string &buffer, uint8_t &type, uint8_t &flags,
+		uint32_t &stream_id, string &payload) {
+	char chunk[65536];
+	while (true) {
+		if (buffer.size() >= http2::FRAME_HEADER_SIZE) {
+			const uint8_t *header = reinterpret_cast<const uint8_t*>(buffer.data());
+			uint32_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+			if (buffer.size() >= http2::FRAME_HEADER_SIZE + length) {
+				type = header[3];
+				flags = header[4];
+				stream_id = http2::readUint32(header + 5) & 0x7fffffff;
+				payload = buffer.substr(http2::FRAME_HEADER_SIZE, length);
+				buffer.erase(0, http2::FRAME_HEADER_SIZE + length);
+				return true;
+			}
+		}
+		ssize_t n = recv(sock, chunk, sizeof(chunk), 0);
+		if (n <= 0) {
+			return false;
+		}
+		buffer.append(chunk, n);
+	}
+}
+
+/**
+ * Our SETTINGS: no server push, and the requested stream window.
+ */
+string settingsPayload(uint32_t window) {
+	string payload;
+	payload += static_cast<char>(0);
+	payload += static_cast<char>(http2::ENABLE_PUSH);
+	http2::appendUint32(payload, 0);
+	payload += static_cast<char>(0);
+	payload += static_cast<char>(http2::INITIAL_WINDOW_SIZE);
+	http2::appendUint32(payload, window);
+	return payload;
+}
+
+/**
+ * Encodes unpadded base64url, for the HTTP2-Settings header.
+ */
+string base64UrlEncode(const string &in) {
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	string out;
+	uint32_t bits = 0;
+	int pending = 0;
+	for (unsigned char c : in) {
+		bits = (bits << 8) | c;
+		pending += 8;
+		while (pending >= 6) {
+			pending -= 6;
+			out += alphabet[(bits >> pending) & 0x3f];
+		}
+	}
+	if (pending > 0) {
+		out += alphabet[(bits << (6 - pending)) & 0x3f];
+	}
+	return out;
+}
+
+/**
+ * Reads a whole file (index.html for directory paths).
+ */
+string readFile(const string &path, bool &found) {
+	string name = path;
+	if (!name.empty() && name.back() == '/') {
+		name += "index.html";
+	}
+	std::ifstream file(name, std::ios::binary);
+	found = file.good();
+	std::stringstream contents;
+	contents << file.rdbuf();
+	return contents.str();
+}
@@ -0,0 +1,296 @@
+/**
+ * torero-replay: replays a traffic capture against a running torero-serve.
+ *
+ * The capture is recorded by running the server with "--capture FILE". Each
+ * captured connection is reopened and its request bytes are resent with the
+ * original timing (scaled by --speed). The response is compared against the
+ * length and hash recorded at capture time. HTTP/2 connections are skipped.
+ *
+ * Usage: ./torero-replay (capture file) (port #) [options]
+ * 	--host ADDR		IPv4 address of the server (default 127.0.0.1)
+ * 	--speed X		replay X times faster than recorded; 0 = no delays
+ * 	--parallel N	number of connections replayed at once (default 8)
+ */
+
+// standard C libraries
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+// operating system specific libraries
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// C++ standard libraries
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Capture.hpp"
+#include "Stats.hpp"
+
+using std::cout;
+using std::string;
+using std::vector;
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Outcome of replaying one captured connection.
+ */
+struct ReplayResult {
+	bool failed = false;
+	bool mismatched = false;
+	double latency_ms = 0;
+};
+
+int connectToServer(const string &host, int port);
+ReplayResult replayConnection(const CapturedConnection &conn, const string &host,
+		int port, Clock::time_point replay_start, uint64_t capture_start,
+		double speed);
+void waitUntil(Clock::time_point replay_start, uint64_t offset_us, double speed);
+bool isHttp2(const CapturedConnection &conn);
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		cout << "INCORRECT USAGE!\n";
+		cout << "Proper Format: ./torero-replay (capture file) (port #) [--host ADDR] [--speed X] [--parallel N]\n";
+		cout << "Example: ./torero-replay traffic.cap 7101 --speed 4 --parallel 16\n";
+		exit(1);
+	}
+
+	string capture_file(argv[1]);
+	int port = std::stoi(argv[2]);
+	string host("127.0.0.1");
+	double speed = 1.0;
+	int parallel = 8;
+
+	for (int i = 3; i < argc; ++i) {
+		string flag(argv[i]);
+		if (i + 1 >= argc) {
+			cout << "Missing value for " << flag << "\n";
+			exit(1);
+		}
+		string value(argv[++i]);
+		if (flag == "--host") {
+			host = value;
+		}
+		else if (flag == "--speed") {
+			speed = std::stod(value);
+		}
+		else if (flag == "--parallel") {
+			parallel = std::max(1, std::stoi(value));
+		}
+		else {
+			cout << "Unknown option: " << flag << "\n";
+			exit(1);
+		}
+	}
+
+	vector<CapturedConnection> connections = Capture::load(capture_file);
+	if (connections.empty()) {
+		cout << "No connections in " << capture_file << "\n";
+		return 0;
+	}
+	uint64_t capture_start = connections.front().opened_at;
+
+	size_t skipped = connections.size();
+	connections.erase(std::remove_if(connections.begin(), connections.end(), isHttp2),
+			connections.end());
+	skipped -= connections.size();
+	if (skipped > 0) {
+		cout << "skipping " << skipped << " HTTP/2 connection(s); only HTTP/1.x is replayed\n";
+	}
+
+	vector<ReplayResult> results(connections.size());
+	std::atomic<size_t> next(0);
+	Clock::time_point replay_start = Clock::now();
+
+	// each replayer takes the next connection (in capture order) until none
+	// are left, so at most "parallel" connections are in flight
+	vector<std::thread> replayers;
+	for (int i = 0; i < parallel; ++i) {
+		replayers.emplace_back([&]() {
+			size_t index;
+			while ((index = next++) < connections.size()) {
+				results[index] = replayConnection(connections[index], host,
+						port, replay_start, capture_start, speed);
+			}
+		});
+	}
+	for (std::thread &t : replayers) {
+		t.join();
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - replay_start).count();
+
+	vector<double> latencies;
+	size_t failures = 0, mismatches = 0;
+	for (size_t i = 0; i < results.size(); ++i) {
+		if (results[i].failed) {
+			failures++;
+			continue;
+		}
+		if (results[i].mismatched) {
+			mismatches++;
+			cout << "mismatch: connection " << connections[i].id << " ("
+				<< connections[i].chunks.size() << " request chunks)\n";
+		}
+		latencies.push_back(results[i].latency_ms);
+	}
+	std::sort(latencies.begin(), latencies.end());
+
+	double total = 0;
+	for (double l : latencies) {
+		total += l;
+	}
+
+	cout << "connections: " << connections.size()
+		<< "  failed: " << failures
+		<< "  mismatched: " << mismatches << "\n";
+	cout << "elapsed: " << elapsed << " s  ("
+		<< (connections.size() / elapsed) << " conn/s)\n";
+	if (!latencies.empty()) {
+		cout << "latency ms: min " << latencies.front()
+			<< "  mean " << (total / latencies.size())
+			<< "  p50 " << percentile(latencies, 0.50)
+			<< "  p90 " << percentile(latencies, 0.90)
+			<< "  p99 " << percentile(latencies, 0.99)
+			<< "  max " << latencies.back() << "\n";
+	}
+
+	return (failures == 0 && mismatches == 0) ? 0 : 2;
+}
+
+/**
+ * Opens a TCP connection to the server.
+ *
+ * @return The connected socket, or -1 on failure.
+ */
+int connectToServer(const string &host, int port) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("Creating socket failed");
+		return -1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+		std::cerr << "Bad host address: " << host << "\n";
+		exit(1);
+	}
+
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("Connecting to server failed");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/**
+ * Sleeps until the replay clock reaches the given capture offset.
+ */
+void waitUntil(Clock::time_point replay_start, uint64_t offset_us, double speed) {
+	if (speed <= 0) {
+		return;
+	}
+	auto due = replay_start + std::chrono::microseconds(
+			static_cast<uint64_t>(offset_us / speed));
+	std::this_thread::sleep_until(due);
+}
+
+/**
+ * Replays one captured connection: connects when it originally connected,
+ * sends each request chunk at its recorded offset, and reads the response
+ * until the server closes the connection.
+ */
+ReplayResult replayConnection(const CapturedConnection &conn, const string &host,
+		int port, Clock::time_point replay_start, uint64_t capture_start,
+		double speed) {
+	ReplayResult result;
+	waitUntil(replay_start, conn.opened_at - capture_start, speed);
+
+	Clock::time_point began = Clock::now();
+	int sock = connectToServer(host, port);
+	if (sock < 0) {
+		result.failed = true;
+		return result;
+	}
+
+	for (size_t i = 0; i < conn.chunks.size(); ++i) {
+		waitUntil(replay_start, conn.chunk_times[i] - capture_start, speed);
+		const string &chunk = conn.chunks[i];
+		size_t sent = 0;
+		while (sent < chunk.size()) {
+			ssize_t n = send(sock, chunk.data() + sent, chunk.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0) {
+				result.failed = true;
+				close(sock);
+				return result;
+			}
+			sent += n;
+		}
+	}
+
+	uint64_t length = 0;
+	uint64_t hash = Capture::HASH_SEED;
+	char buffer[16384];
+	while (true) {
+		ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// a reset after the full response still counts as a response
+			break;
+		}
+		if (n == 0) {
+			break;
+		}
+		length += n;
+		hash = Capture::hash(hash, buffer, n);
+	}
+	close(sock);
+
+	result.latency_ms = std::chrono::duration<double, std::milli>(
+			Clock::now() - began).count();
+	if (conn.has_response) {
+		result.mismatched = (length != conn.response_length)
+			|| (hash != conn.response_hash);
+	}
+	return result;
+}
+
+/**
+ * Whether a captured connection spoke HTTP/2 (prior knowledge, or an
+ * "Upgrade: h2c" request). Those are skipped: their responses are framed
+ * per stream and the server keeps the connection open until it idles out,
+ * so a whole-connection replay would only report a slow mismatch.
+ */
+bool isHttp2(const CapturedConnection &conn) {
+	if (conn.chunks.empty()) {
+		return false;
+	}
+	static const string PREFACE("PRI * HTTP/2.0\r\n");
+	const string &first = conn.chunks.front();
+	size_t n = std::min(first.size(), PREFACE.size());
+	if (n > 0 && first.compare(0, n, PREFACE, 0, n) == 0) {
+		return true;
+	}
+
+	size_t head_end = first.find("\r\n\r\n");
+	string head = first.substr(0, head_end);
+	std::transform(head.begin(), head.end(), head.begin(), ::tolower);
+	return head.find("\r\nupgrade: h2c") != string::npos;
+}
@@ -6,6 +6,34 @@
  * 	1. The port number on which to bind and listen for connections
  * 	2. The directory out of which to serve files.
  *
+ * Optional flags may follow the two arguments:
+ * 	--trace FILE		write a Chrome Trace Event JSON file of request stages
+ * 	--trace-sample N	keep the trace of one out of every N requests
+ * 	--trace-slow-ms MS	always keep (and report) requests slower than MS
+ * 	--capture FILE		record raw requests to a log for torero-replay
+ * 	--accept-batch N	accept up to N pending connections per wakeup
+ * 	--backlog N			length of the listen queue
+ * 	--defer-accept SECS	TCP_DEFER_ACCEPT: only wake for connections with data
+ * 	--fastopen QLEN		TCP_FASTOPEN with the given pending-cookie queue
+ * 	--nodelay			set TCP_NODELAY on client sockets
+ * 	--sndbuf BYTES		SO_SNDBUF for client sockets
+ * 	--rcvbuf BYTES		SO_RCVBUF for client sockets
+ * 	--proxy PREFIX=HOST:PORT	forward requests under PREFIX to an upstream
+ * 	--proxy PREFIX=unix:PATH	(may be repeated; also takes Unix sockets)
+ * 	--proxy-timeout-ms MS	timeout for upstream connects and I/O
+ * 	--proxy-health-ms MS	interval between upstream health checks (0 = off)
+ * 	--tls-cert FILE		serve HTTPS using this PEM certificate chain...
+ * 	--tls-key FILE		...and this PEM private key
+ * 	--no-ktls			encrypt in user space even if kernel TLS is available
+ * 	--per-core N		topology-aware mode on N CPUs (0 = every allowed CPU):
+ * 						a pinned acceptor, queue and workers per CPU
+ * 	--incoming-cpu		with --per-core, set SO_INCOMING_CPU on each listener
+ * 	--index-threads N	threads scanning the root at startup (default: one
+ * 						per CPU)
+ *
+ * Without TLS, clients may also speak cleartext HTTP/2 (h2c), either with
+ * prior knowledge or by upgrading an HTTP/1.1 GET with "Upgrade: h2c".
+ *
  * Author 1: Eduardo Ortega
  * Author 2: Cecilia Barnhill
  */
@@ -18,12 +46,17 @@
 
 // operating system specific libraries
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <csignal>
+#include <pthread.h>
 #include <bits/stdc++.h>
 
 // C++ standard libraries
@@ -36,6 +69,13 @@
 #include <regex>
 
 #include "BoundedBuffer.hpp"
+#include "Tracer.hpp"
+#include "Capture.hpp"
+#include "Proxy.hpp"
+#include "Tls.hpp"
+#include "Http2.hpp"
+#include "Topology.hpp"
+#include "SiteIndex.hpp"
 
 // Import Filesystem and shorten its namespace to "fs"
 #include <filesystem>
@@ -52,55 +92,298 @@ using std::smatch;
 static const int BACKLOG = 10;
 static const int BUFFER_SIZE = 10;
 static const int NUM_CONSUMERS = 8;
+// how long the accept loop waits after running out of file descriptors
+static const int ACCEPT_BACKOFF_MS = 10;
+
+/**
+ * Tunables for the listening socket and the accept loop. Zero means "leave
+ * the kernel default alone".
+ */
+struct AcceptOptions {
+	int batch = 16;			// most connections accepted per wakeup
+	int backlog = BACKLOG;	// listen() queue length
+	int defer_accept = 0;	// TCP_DEFER_ACCEPT timeout in seconds
+	int fastopen = 0;		// TCP_FASTOPEN queue length
+	bool nodelay = false;	// TCP_NODELAY on accepted sockets
+	int sndbuf = 0;			// SO_SNDBUF, inherited by accepted sockets
+	int rcvbuf = 0;			// SO_RCVBUF, inherited by accepted sockets
+};
+static AcceptOptions accept_options;
+
+/**
+ * Settings for the topology-aware (--per-core) mode.
+ */
+struct PlacementOptions {
+	bool enabled = false;
+	int cores = 0;				// how many CPUs to use; 0 means all allowed
+	bool incoming_cpu = false;	// SO_INCOMING_CPU on each core's listener
+};
+static PlacementOptions placement_options;
+
+// threads used to build the site index; 0 means one per CPU
+static int index_threads = 0;
+
+/*
+ * An HTTP/2 connection keeps its worker until the client leaves or goes
+ * idle, so only this many of a queue's workers may run one at a time; the
+ * rest stay free for HTTP/1.x. Pinned workers count against their CPU's
+ * slots, floating workers all share slot 0.
+ */
+static int h2_session_limit = NUM_CONSUMERS / 2;
+static std::atomic<int> h2_sessions[CPU_SETSIZE];
+static thread_local int worker_cpu = 0;
+
+/**
+ * Takes one of the calling worker's HTTP/2 session slots, if one is free,
+ * and gives it back when it goes out of scope.
+ */
+struct Http2Slot {
+	Http2Slot() {
+		held = (h2_sessions[worker_cpu].fetch_add(1) < h2_session_limit);
+		if (!held) {
+			h2_sessions[worker_cpu].fetch_sub(1);
+		}
+	}
+	~Http2Slot() {
+		if (held) {
+			h2_sessions[worker_cpu].fetch_sub(1);
+		}
+	}
+	bool held;
+};
+
+// set by the SIGINT/SIGTERM handler so the accept loop can wind down
+static volatile sig_atomic_t shutting_down = 0;
+
+// body of every 404 response
+static const char NOT_FOUND_PAGE[] = "<html><head><title>Ruh-roh! Page not found!</title></head><body><h1>404 Page Not Found! :'( :'( :'(</h1></body></html>";
 
 // forward declarations from started code
 int createSocketAndListen(const int port_num);
-void acceptConnections(const int server_sock, string rootDir);
-void handleClient(const int client_sock, string rootDir);
+void acceptConnections(const int server_sock, const int port_num);
+void acceptLoop(const int server_sock, BoundedBuffer &buffer);
+BoundedBuffer *startCores(const int server_sock, const int port_num);
+BoundedBuffer *startCoreWorkers(int cpu, int workers);
+void coreThread(int cpu, const int server_sock, int workers);
+void handleClient(const int client_sock);
+void finishClient(const int client_sock, string label);
 void sendData(int socked_fd, const char *data, size_t data_length);
 int receiveData(int socked_fd, char *dest, size_t buff_size);
+void waitForSocket(int socked_fd, short events);
 
 //forward declarations from functions we add in
 void sendHTTP400(string version, const int client_sock);
 void sendHTTP404(string version, const int client_sock);
-void sendHTTP200(string version, const int client_sock, string fileName);
+void sendHTTP200(string version, const int client_sock, const SiteEntry &entry);
 string regexCheck(string request_string, string format);
 string getVer(string requestChecked);
 string getObj(string requestChecked);
-void sendHead(string object, const int client_sock);
-void sendObj(string object, const int client_sock);
+string getTarget(string request_string);
+void sendHead(const SiteEntry &entry, const int client_sock);
+void sendObj(const SiteEntry &entry, int file_fd, const int client_sock);
 string fileType(string fileName);
-bool checkFile(string fileName);
-bool checkDir(string thePath);
 void createAndSendIndexAndHTTP200(string theDirectory, string version, const int client_sock);
-void consumerThread(BoundedBuffer &buffer, string rootDir);
+string buildIndexPage(string object);
+Http2Response resolveHttp2(string path);
+bool wantsH2cUpgrade(string request_string, string &settings);
+bool upgradeToHttp2(const int client_sock, string object, string settings);
+void consumerThread(BoundedBuffer &buffer, int cpu);
+void parseOptions(int argc, char** argv);
+void handleShutdownSignal(int signum);
+void setSocketOption(int sock, int level, int name, int value, const char *what);
 
 int main(int argc, char** argv) {
 
 	/* Make sure the user called our program correctly. */
-	if (argc != 3) {
+	if (argc < 3) {
 		//print a proper error message informing user of proper usage
 		cout << "INCORRECT USAGE!\n";
-		cout << "Proper Format: ./(insert executable) (port #) (root directory)\n";
+		cout << "Proper Format: ./(insert executable) (port #) (root directory) [options]\n";
 		cout << "Example: ./torero-serve 7101 WWW\n";
+		cout << "Example: ./torero-serve 7101 WWW --trace trace.json --trace-sample 10 --trace-slow-ms 50\n";
+		cout << "Example: ./torero-serve 7101 WWW --capture traffic.cap\n";
+		cout << "Example: ./torero-serve 7101 WWW --defer-accept 5 --fastopen 256 --nodelay\n";
+		cout << "Example: ./torero-serve 7101 WWW --proxy /api=127.0.0.1:9000 --proxy /app=unix:/run/app.sock\n";
+		cout << "Example: ./torero-serve 7443 WWW --tls-cert cert.pem --tls-key key.pem\n";
+		cout << "Example: ./torero-serve 7101 WWW --per-core 0 --incoming-cpu\n";
 		exit(1);
 	}
+	/*
+	 * sendfile(), splice() and OpenSSL's socket writes don't take
+	 * MSG_NOSIGNAL, so a client that hangs up mid-response would otherwise
+	 * kill the whole server with SIGPIPE. Ignored, those writes fail with
+	 * EPIPE and only that connection is dropped.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	parseOptions(argc, argv);
 
     //* Read the port number from the first command line argument. */
     int port = std::stoi(argv[1]);
 	string rootDir = std::string(argv[2]);
+
+	/* Index everything under the root before taking requests. */
+	if (index_threads <= 0) {
+		index_threads = std::thread::hardware_concurrency();
+	}
+	SiteIndex::start(rootDir, index_threads, fileType);
+
 	/* Create a socket and start listening for new connections on the
 	 * specified port. */
 	int server_sock = createSocketAndListen(port);
 
 	/* Now let's start accepting connections. */
-	acceptConnections(server_sock, rootDir);
+	acceptConnections(server_sock, port);
 
     close(server_sock);
+	Tracer::finish();
 
 	return 0;
 }
 
+/**
+ * Reads the optional flags that follow the port and root directory.
+ *
+ * @param argc The argument count given to main.
+ * @param argv The arguments given to main.
+ */
+void parseOptions(int argc, char** argv) {
+	string trace_file;
+	int trace_sample = 1;
+	double trace_slow_ms = 0;
+	int proxy_health_ms = 2000;
+	string tls_cert, tls_key;
+	bool use_ktls = true;
+
+	for (int i = 3; i < argc; ++i) {
+		string flag(argv[i]);
+
+		// flags that take no value
+		if (flag == "--nodelay") {
+			accept_options.nodelay = true;
+			continue;
+		}
+		if (flag == "--no-ktls") {
+			use_ktls = false;
+			continue;
+		}
+		if (flag == "--incoming-cpu") {
+			placement_options.incoming_cpu = true;
+			continue;
+		}
+
+		if (i + 1 >= argc) {
+			cout << "Missing value for " << flag << "\n";
+			exit(1);
+		}
+		string value(argv[++i]);
+
+		if (flag == "--trace") {
+			trace_file = value;
+		}
+		else if (flag == "--trace-sample") {
+			trace_sample = std::stoi(value);
+		}
+		else if (flag == "--trace-slow-ms") {
+			trace_slow_ms = std::stod(value);
+		}
+		else if (flag == "--capture") {
+			Capture::start(value);
+			//OPEN records carry the accept time, not when a worker got to it
+			Tracer::recordAccepts();
+		}
+		else if (flag == "--accept-batch") {
+			accept_options.batch = std::max(1, std::stoi(value));
+		}
+		else if (flag == "--backlog") {
+			accept_options.backlog = std::stoi(value);
+		}
+		else if (flag == "--defer-accept") {
+			accept_options.defer_accept = std::stoi(value);
+		}
+		else if (flag == "--fastopen") {
+			accept_options.fastopen = std::stoi(value);
+		}
+		else if (flag == "--sndbuf") {
+			accept_options.sndbuf = std::stoi(value);
+		}
+		else if (flag == "--rcvbuf") {
+			accept_options.rcvbuf = std::stoi(value);
+		}
+		else if (flag == "--proxy") {
+			Proxy::addRoute(value);
+		}
+		else if (flag == "--proxy-timeout-ms") {
+			Proxy::setTimeout(std::stoi(value));
+		}
+		else if (flag == "--proxy-health-ms") {
+			proxy_health_ms = std::stoi(value);
+		}
+		else if (flag == "--index-threads") {
+			index_threads = std::stoi(value);
+		}
+		else if (flag == "--per-core") {
+			placement_options.enabled = true;
+			placement_options.cores = std::max(0, std::stoi(value));
+		}
+		else if (flag == "--tls-cert") {
+			tls_cert = value;
+		}
+		else if (flag == "--tls-key") {
+			tls_key = value;
+		}
+		else {
+			cout << "Unknown option: " << flag << "\n";
+			exit(1);
+		}
+	}
+
+	if (!trace_file.empty()) {
+		Tracer::start(trace_file, trace_sample, trace_slow_ms);
+	}
+	Proxy::startHealthChecks(proxy_health_ms);
+
+	if (tls_cert.empty() != tls_key.empty()) {
+		cout << "--tls-cert and --tls-key must be given together\n";
+		exit(1);
+	}
+	if (!tls_cert.empty()) {
+		Tls::start(tls_cert, tls_key, use_ktls);
+	}
+
+	if (placement_options.incoming_cpu && !placement_options.enabled) {
+		cout << "--incoming-cpu needs --per-core\n";
+		exit(1);
+	}
+}
+
+/**
+ * Asks the accept loop to stop so main can write out anything still buffered
+ * (e.g. the trace) before exiting.
+ *
+ * @param signum The signal that was caught (unused).
+ */
+void handleShutdownSignal(int signum) {
+	(void)signum;
+	shutting_down = 1;
+}
+
+/**
+ * Sets an integer socket option, exiting with an error message on failure.
+ *
+ * @param sock The socket to configure.
+ * @param level The protocol level (e.g. SOL_SOCKET, IPPROTO_TCP).
+ * @param name The option name (e.g. SO_SNDBUF).
+ * @param value The value to set.
+ * @param what Description used in the error message.
+ */
+void setSocketOption(int sock, int level, int name, int value, const char *what) {
+	if (setsockopt(sock, level, name, &value, sizeof(value)) < 0) {
+		perror(what);
+		exit(1);
+	}
+}
+
 /**
  * Sends message over given socket, raising an exception if there was a problem
  * sending.
@@ -110,17 +393,24 @@ int main(int argc, char** argv) {
  * @param data_length Number of bytes of data to send.
  */
 void sendData(int socked_fd, const char *data, size_t data_length) {
+	Capture::responseData(socked_fd, data, data_length);
+
 	//zero initialization
-	int num_bytes_sent(0);
-	int convertDataLength = static_cast<int>(data_length); //converting to compare ints
-	//while loop to get to the data_length threshold and the num bytes sent is
-	//positve
-	while(num_bytes_sent < convertDataLength){
-		int sent = send(socked_fd, data, data_length, 0);
+	size_t num_bytes_sent(0);
+	//while loop to get to the data_length threshold, picking up where the
+	//last (possibly partial) send left off
+	while(num_bytes_sent < data_length){
+		short wait_for;
+		ssize_t sent = Tls::send(socked_fd, data + num_bytes_sent,
+				data_length - num_bytes_sent, wait_for);
 		if (sent == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				//client sockets are non-blocking: wait for room and retry
+				waitForSocket(socked_fd, wait_for);
+				continue;
+			}
 			std::error_code ec(errno, std::generic_category());
 			throw std::system_error(ec, "send failed");
-			exit(1);
 		}
 		else if(sent == 0)
 		{
@@ -134,6 +424,25 @@ void sendData(int socked_fd, const char *data, size_t data_length) {
 	}
 }
 
+/**
+ * Blocks until the (non-blocking) socket is ready for the given event.
+ *
+ * @param socked_fd The socket to wait on.
+ * @param events POLLIN or POLLOUT.
+ */
+void waitForSocket(int socked_fd, short events) {
+	struct pollfd pfd;
+	pfd.fd = socked_fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	while (poll(&pfd, 1, -1) < 0) {
+		if (errno != EINTR) {
+			std::error_code ec(errno, std::generic_category());
+			throw std::system_error(ec, "poll failed");
+		}
+	}
+}
+
 /**
  * Receives message over given socket, raising an exception if there was an
  * error in receiving.
@@ -144,7 +453,14 @@ void sendData(int socked_fd, const char *data, size_t data_length) {
  * @return The number of bytes received and written to the destination buffer.
  */
 int receiveData(int socked_fd, char *dest, size_t buff_size) {
-	int num_bytes_received = recv(socked_fd, dest, buff_size, 0);
+	short wait_for;
+	int num_bytes_received = Tls::recv(socked_fd, dest, buff_size, wait_for);
+	while (num_bytes_received == -1
+			&& (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		//nothing has arrived yet on the non-blocking socket
+		waitForSocket(socked_fd, wait_for);
+		num_bytes_received = Tls::recv(socked_fd, dest, buff_size, wait_for);
+	}
 	if (num_bytes_received == -1) {
 		std::error_code ec(errno, std::generic_category());
 		throw std::system_error(ec, "recv failed");
@@ -161,47 +477,127 @@ int receiveData(int socked_fd, char *dest, size_t buff_size) {
  * may not be used again).
  *
  * @param client_sock The client's socket file descriptor.
- * @param rootDir The root Directory entered in the command line arguments
  */
-void handleClient(const int client_sock, string rootDir) {
+void handleClient(const int client_sock) {
+	uint64_t accepted_at = Tracer::beginRequest(client_sock);
+	Capture::beginConnection(client_sock, accepted_at);
+
+	if (Tls::enabled())
+	{
+		bool handshake_ok;
+		{
+			TraceSpan span("tls_handshake");
+			handshake_ok = Tls::accept(client_sock);
+		}
+		if (!handshake_ok)
+		{
+			finishClient(client_sock, "TLS handshake failed");
+			return;
+		}
+	}
+
 	// Step 1: Receive the request message from the client
 	char received_data[2048];
-	int bytes_received = receiveData(client_sock, received_data, 2048);
+	int bytes_received;
+	{
+		TraceSpan span("recv");
+		bytes_received = receiveData(client_sock, received_data, 2048);
+	}
+	Capture::requestData(received_data, bytes_received);
 	
 	// Turn the char array into a C++ string for easier processing.
 	string request_string(received_data, bytes_received);
+
+	// A cleartext client that knows we speak HTTP/2 opens with the
+	// connection preface instead of a request line.
+	if (!Tls::enabled() && bytes_received > 0 && Http2Session::looksLikePreface(request_string))
+	{
+		while (request_string.size() < http2::PREFACE.size()
+				&& Http2Session::looksLikePreface(request_string))
+		{
+			bytes_received = receiveData(client_sock, received_data, 2048);
+			if (bytes_received == 0)
+			{
+				break;
+			}
+			Capture::requestData(received_data, bytes_received);
+			request_string.append(received_data, bytes_received);
+		}
+		if (Http2Session::looksLikePreface(request_string))
+		{
+			Http2Session session(client_sock, resolveHttp2);
+			Http2Slot slot;
+			if (slot.held)
+			{
+				session.run(request_string);
+			}
+			else
+			{
+				session.refuse();
+			}
+			finishClient(client_sock, slot.held ? "HTTP/2" : "HTTP/2 refused");
+			return;
+		}
+	}
+
+	// Requests under a proxied path prefix go to their upstream instead of
+	// being served out of the root directory.
+	if (Proxy::enabled())
+	{
+		const ProxyRoute *route = Proxy::match(getTarget(request_string));
+		if (route != nullptr)
+		{
+			Proxy::forward(*route, client_sock, request_string);
+			finishClient(client_sock, request_string.substr(0, request_string.find('\r')));
+			return;
+		}
+	}
 		
 	// Step 2: Parse the request string to determine what response to generate.
 	// I recommend using regular expressions (specifically C++'s std::regex) to
 	// determine if a request is properly formatted.
+	string requestChecked, version, object;
+	{
+		TraceSpan span("parse");
 
-	//check the format of the request_string	
-	string format("(GET\\s[\\w\\-\\./]*\\sHTTP/\\d\\.\\d)");
-	string requestChecked(regexCheck(request_string, format));
+		//check the format of the request_string	
+		string format("(GET\\s[\\w\\-\\./]*\\sHTTP/\\d\\.\\d)");
+		requestChecked = regexCheck(request_string, format);
 
-	//from the checked request_string to requestChecked, obtain the object and
-	//version of the request
-	string version(getVer(requestChecked));
-	string object(getObj(requestChecked));
+		//from the checked request_string to requestChecked, obtain the object and
+		//version of the request
+		version = getVer(requestChecked);
+		object = getObj(requestChecked);
+	}
 	
 	// Step 3: Generate HTTP response message based on the request you received.
 	
 	//check if the request is bad
+	string h2_settings;
 	if ((requestChecked == "empty") || (version == "empty") || (object == "empty"))
 	{
 		sendHTTP400(version, client_sock);
 	}
+	else if (!Tls::enabled() && wantsH2cUpgrade(request_string, h2_settings)
+			&& upgradeToHttp2(client_sock, object, h2_settings))
+	{
+		//answered as stream 1 of the upgraded connection
+	}
 	else //means that request if good
 	{
-		object = rootDir + object;
-		if ((checkDir(object)) && (object[object.length() - 1] == '/')) //checks the path to the object of interest to see if it is a directory
+		//one walk through the site index tells us what the path is
+		SiteEntry entry;
+		{
+			TraceSpan span("lookup");
+			entry = SiteIndex::resolve(object);
+		}
+		if ((entry.kind == SiteEntry::DIRECTORY) && (object[object.length() - 1] == '/')) //checks the path to the object of interest to see if it is a directory
 		{
-			string indexToCheck(object + "index.html");
-			if(checkFile(indexToCheck)) //checks if index.html exists
+			if(entry.has_index) //checks if index.html exists
 			{
 				//index exists in directory or it is specified so we send the
 				//200 OK response
-				sendHTTP200(version, client_sock, (object + "index.html"));
+				sendHTTP200(version, client_sock, entry);
 			}
 			else
 			{
@@ -209,10 +605,10 @@ void handleClient(const int client_sock, string rootDir) {
 				createAndSendIndexAndHTTP200(object, version, client_sock);
 			}
 		}
-		else if(checkFile(object)) //checks if file exists
+		else if((entry.kind == SiteEntry::FILE) && (object[object.length() - 1] != '/')) //checks if file exists (a trailing slash means a directory was asked for)
 		{
 			//file exists so we send the 200 OK response
-			sendHTTP200(version, client_sock, object);
+			sendHTTP200(version, client_sock, entry);
 		}
 		else
 		{
@@ -222,8 +618,25 @@ void handleClient(const int client_sock, string rootDir) {
 		}
 	}	
 	
+	finishClient(client_sock, requestChecked);
+}
+
+/**
+ * Closes the connection with the client and wraps up capturing and tracing
+ * for it.
+ *
+ * @param client_sock The client's socket file descriptor.
+ * @param label What to call the request in the trace.
+ */
+void finishClient(const int client_sock, string label) {
 	// Close connection with client.
-	close(client_sock);
+	Capture::endConnection();
+	{
+		TraceSpan span("close");
+		Tls::shutdown(client_sock);
+		close(client_sock);
+	}
+	Tracer::endRequest(label);
 }
 
 /**
@@ -234,7 +647,8 @@ void handleClient(const int client_sock, string rootDir) {
  * @returns The socket file descriptor
  */
 int createSocketAndListen(const int port_num) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+	// non-blocking so the accept loop can drain it without getting stuck
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sock < 0) {
         perror("Creating socket failed");
         exit(1);
@@ -263,6 +677,29 @@ int createSocketAndListen(const int port_num) {
         exit(1);
     }
 
+	/*
+	 * In per-core mode every core has its own listening socket on the same
+	 * port, and the kernel spreads incoming connections across them.
+	 */
+	if (placement_options.enabled) {
+		setSocketOption(sock, SOL_SOCKET, SO_REUSEPORT, 1,
+				"Setting SO_REUSEPORT failed");
+	}
+
+	/*
+	 * Buffer sizes set on the listening socket are inherited by every
+	 * accepted socket. The receive buffer has to be sized before listen() so
+	 * the TCP window scale offered during the handshake matches it.
+	 */
+	if (accept_options.sndbuf > 0) {
+		setSocketOption(sock, SOL_SOCKET, SO_SNDBUF, accept_options.sndbuf,
+				"Setting SO_SNDBUF failed");
+	}
+	if (accept_options.rcvbuf > 0) {
+		setSocketOption(sock, SOL_SOCKET, SO_RCVBUF, accept_options.rcvbuf,
+				"Setting SO_RCVBUF failed");
+	}
+
     /*
 	 * Create an address structure.  This is very similar to what we saw on the
      * client side, only this time, we're not telling the OS where to connect,
@@ -296,12 +733,27 @@ int createSocketAndListen(const int port_num) {
 	 * tells the OS how much space to reserve for incoming connections that have
 	 * not yet been accepted.
 	 */
-    retval = listen(sock, BACKLOG);
+    retval = listen(sock, accept_options.backlog);
     if (retval < 0) {
         perror("Error listening for connections");
         exit(1);
     }
 
+	/*
+	 * TCP_DEFER_ACCEPT keeps a connection in the kernel until the client has
+	 * actually sent something (or the timeout passes), so workers are never
+	 * woken just to wait for a request. TCP_FASTOPEN lets returning clients
+	 * put their request in the SYN and skip a round trip.
+	 */
+	if (accept_options.defer_accept > 0) {
+		setSocketOption(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+				accept_options.defer_accept, "Setting TCP_DEFER_ACCEPT failed");
+	}
+	if (accept_options.fastopen > 0) {
+		setSocketOption(sock, IPPROTO_TCP, TCP_FASTOPEN,
+				accept_options.fastopen, "Setting TCP_FASTOPEN failed");
+	}
+
 	return sock;
 }
 
@@ -309,43 +761,223 @@ int createSocketAndListen(const int port_num) {
  * Sit around forever accepting new connections from client.
  *
  * @param server_sock The socket used by the server.
- * @param rootDir The root Directory entered in the command line arguments
+ * @param port_num The port server_sock listens on.
  */
-void acceptConnections(const int server_sock, string rootDir) {
- 	BoundedBuffer buff(BUFFER_SIZE);
-	for(size_t i = 0; i < NUM_CONSUMERS; ++i)
+void acceptConnections(const int server_sock, const int port_num) {
+	/*
+	 * Only this thread should see SIGINT/SIGTERM, so the consumers are started
+	 * with those signals blocked. The handler is installed without SA_RESTART
+	 * so that a blocked accept() returns with EINTR.
+	 */
+	sigset_t shutdown_signals;
+	sigemptyset(&shutdown_signals);
+	sigaddset(&shutdown_signals, SIGINT);
+	sigaddset(&shutdown_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+
+	// never freed: the detached consumers keep waiting on it until exit
+	BoundedBuffer *buff;
+	if (placement_options.enabled)
 	{
-		std::thread consumer(consumerThread, std::ref(buff), rootDir);
-		consumer.detach();
+		buff = startCores(server_sock, port_num);
+	}
+	else
+	{
+		buff = new BoundedBuffer(BUFFER_SIZE);
+		for(size_t i = 0; i < NUM_CONSUMERS; ++i)
+		{
+			std::thread consumer(consumerThread, std::ref(*buff), -1);
+			consumer.detach();
+		}
 	}
 
-    while (true) {
-        // Declare a socket for the client connection.
-        int sock;
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handleShutdownSignal;
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+	pthread_sigmask(SIG_UNBLOCK, &shutdown_signals, nullptr);
+
+	acceptLoop(server_sock, *buff);
+}
+
+/**
+ * Accepts connections on one listening socket and queues them for the
+ * workers behind buffer. Returns once shutdown has been requested (only the
+ * main thread ever sees the signal; other cores' loops run until exit).
+ *
+ * @param server_sock The (non-blocking) listening socket.
+ * @param buffer The queue the workers take connections from.
+ */
+void acceptLoop(const int server_sock, BoundedBuffer &buffer) {
+	std::vector<int> accepted;
+	accepted.reserve(accept_options.batch);
+
+    while (!shutting_down) {
+		/*
+		 * Sleep until at least one connection is waiting. The listening socket
+		 * is non-blocking, so the shutdown handler interrupts this
+		 * with EINTR and the loop condition decides whether we are done.
+		 */
+		struct pollfd listener;
+		listener.fd = server_sock;
+		listener.events = POLLIN;
+		listener.revents = 0;
+		if (poll(&listener, 1, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error waiting for connections");
+			exit(1);
+		}
 
-        /* 
-		 * Another address structure.  This time, the system will automatically
-         * fill it in, when we accept a connection, to tell us where the
-         * connection came from.
+		/*
+		 * Drain up to a batch of pending connections per wakeup. accept4 hands
+		 * back sockets that are already non-blocking and close-on-exec, which
+		 * saves two fcntl calls per connection. We don't need the client
+		 * address, so none is asked for.
 		 */
-        struct sockaddr_in remote_addr;
-        unsigned int socklen = sizeof(remote_addr); 
-
-        /* 
-		 * Accept the first waiting connection from the server socket and
-         * populate the address information.  The result (sock) is a socket
-         * descriptor for the conversation with the newly connected client.  If
-         * there are no pending connections in the back log, this function will
-         * block indefinitely while waiting for a client connection to be made.
-         */
-        sock = accept(server_sock, (struct sockaddr*) &remote_addr, &socklen);
-        if (sock < 0) {
-            perror("Error accepting connection");
-            exit(1);
-        }
-
-    	buff.putItem(sock);
+		accepted.clear();
+		bool out_of_fds = false;
+		while (static_cast<int>(accepted.size()) < accept_options.batch) {
+			int sock = accept4(server_sock, nullptr, nullptr,
+					SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (sock < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					break; // nothing left in the backlog
+				}
+				if (errno == EMFILE || errno == ENFILE) {
+					// the connection stays in the backlog, so poll would wake
+					// us straight back up; wait for workers to close some fds
+					out_of_fds = true;
+					break;
+				}
+				if (errno == EINTR || errno == ECONNABORTED) {
+					// transient: hand off what we have and try again later
+					break;
+				}
+				perror("Error accepting connection");
+				exit(1);
+			}
+
+			if (accept_options.nodelay) {
+				int on = 1;
+				setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+			}
+			Tracer::noteAccepted(sock);
+			accepted.push_back(sock);
+		}
+
+		buffer.putItems(accepted);
+		if (out_of_fds) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_BACKOFF_MS));
+		}
+	}
+}
+
+/**
+ * Sets up topology-aware mode: every chosen CPU gets its own listening
+ * socket (SO_REUSEPORT), its own connection queue and its own workers, all
+ * pinned to that CPU. A connection is therefore handled on the core that
+ * accepted it, and each core's queue, thread stacks and thread-local buffers
+ * are first touched (so allocated on the local NUMA node) by threads running
+ * there.
+ *
+ * The calling thread becomes the acceptor of the first CPU.
+ *
+ * @param server_sock The listening socket already created by main.
+ * @param port_num The port to open the other cores' listeners on.
+ * @return The first CPU's connection queue.
+ */
+BoundedBuffer *startCores(const int server_sock, const int port_num) {
+	vector<CpuInfo> cpus = Topology::discover();
+	if (cpus.empty())
+	{
+		perror("Reading the CPU topology failed");
+		exit(1);
+	}
+	if (placement_options.cores > 0 && placement_options.cores < (int)cpus.size())
+	{
+		cpus.resize(placement_options.cores);
+	}
+
+	// keep at least as many workers in total as the shared-queue mode has
+	int workers = std::max(2, (NUM_CONSUMERS + (int)cpus.size() - 1) / (int)cpus.size());
+	h2_session_limit = workers / 2;
+
+	cout << "per-core mode: " << cpus.size() << " CPU(s) on "
+		<< Topology::countNodes(cpus) << " NUMA node(s), " << workers
+		<< " worker(s) each:";
+	for (const CpuInfo &info : cpus)
+	{
+		cout << " cpu" << info.cpu << "(node" << info.node << ")";
 	}
+	cout << "\n";
+
+	for (size_t i = 1; i < cpus.size(); ++i)
+	{
+		int listener = createSocketAndListen(port_num);
+		std::thread core(coreThread, cpus[i].cpu, listener, workers);
+		core.detach();
+	}
+
+	if (!Topology::pinThread(cpus[0].cpu))
+	{
+		perror("Pinning the acceptor failed");
+		exit(1);
+	}
+	if (placement_options.incoming_cpu)
+	{
+		setSocketOption(server_sock, SOL_SOCKET, SO_INCOMING_CPU, cpus[0].cpu,
+				"Setting SO_INCOMING_CPU failed");
+	}
+	return startCoreWorkers(cpus[0].cpu, workers);
+}
+
+/**
+ * Creates one CPU's connection queue and starts its pinned workers. Must be
+ * called on that CPU so the queue is allocated from its NUMA node.
+ *
+ * @param cpu The CPU the workers are pinned to.
+ * @param workers How many workers to start.
+ * @return The new queue (never freed, like the shared one).
+ */
+BoundedBuffer *startCoreWorkers(int cpu, int workers) {
+	BoundedBuffer *buff = new BoundedBuffer(BUFFER_SIZE);
+	for (int i = 0; i < workers; ++i)
+	{
+		std::thread consumer(consumerThread, std::ref(*buff), cpu);
+		consumer.detach();
+	}
+	return buff;
+}
+
+/**
+ * Acceptor for every CPU but the first: pins itself, starts the CPU's
+ * workers and accepts on the CPU's own listening socket.
+ *
+ * @param cpu The CPU to run on.
+ * @param server_sock This CPU's listening socket.
+ * @param workers How many workers to start.
+ */
+void coreThread(int cpu, const int server_sock, int workers) {
+	if (!Topology::pinThread(cpu))
+	{
+		perror("Pinning an acceptor failed");
+		exit(1);
+	}
+	/*
+	 * SO_INCOMING_CPU makes the kernel prefer this listener for connections
+	 * whose packets are processed on this CPU; it pays off when NIC queues
+	 * (RSS/RPS) are steered to the same CPUs the listeners are pinned to.
+	 */
+	if (placement_options.incoming_cpu)
+	{
+		setSocketOption(server_sock, SOL_SOCKET, SO_INCOMING_CPU, cpu,
+				"Setting SO_INCOMING_CPU failed");
+	}
+	BoundedBuffer *buff = startCoreWorkers(cpu, workers);
+	acceptLoop(server_sock, *buff);
 }
 
 /**
@@ -356,6 +988,7 @@ void acceptConnections(const int server_sock, string rootDir) {
  */
 void sendHTTP400(string version, const int client_sock)
 {
+	TraceSpan span("send_error");
 	string response400(version + " 400 BAD REQUEST\r\n\r\n");	
 	sendData(client_sock, response400.c_str(), response400.length());
 }
@@ -368,10 +1001,11 @@ void sendHTTP400(string version, const int client_sock)
  */
 void sendHTTP404(string version, const int client_sock)
 {
+	TraceSpan span("send_error");
 	string response404(version + " 404 Not Found\r\n");
 	sendData(client_sock, response404.c_str(), response404.length());
 	
-	string HTMLObject("<html><head><title>Ruh-roh! Page not found!</title></head><body><h1>404 Page Not Found! :'( :'( :'(</h1></body></html>");	
+	string HTMLObject(NOT_FOUND_PAGE);
 	
 	//send the header	
 	string header("Content-Length: " + std::to_string(HTMLObject.size()) + "\r\nContent-Type: text/html\r\n\r\n");
@@ -388,49 +1022,180 @@ void sendHTTP404(string version, const int client_sock)
  *
  * @param version the HTTP version to use
  * @param client_sock the socket to send the HTTP response to
+ * @param entry the file to send, as found in the site index
  */
-void sendHTTP200(string version, const int client_sock, string fileName)
+void sendHTTP200(string version, const int client_sock, const SiteEntry &entry)
 {
+	//open before answering: the file may have gone (or been swapped for a
+	//link) since it was indexed
+	int file_fd = SiteIndex::openFile(entry);
+	if (file_fd < 0)
+	{
+		sendHTTP404(version, client_sock);
+		return;
+	}
 	string response200(version + " 200 OK \r\n");	
-	sendData(client_sock, response200.c_str(), response200.length());
-	sendHead(fileName, client_sock);
-	sendObj(fileName, client_sock);	
+	try
+	{
+		sendData(client_sock, response200.c_str(), response200.length());
+		sendHead(entry, client_sock);
+	}
+	catch (...)
+	{
+		close(file_fd);
+		throw;
+	}
+	sendObj(entry, file_fd, client_sock);	
 }
 
 /*
  * create the index page because it is not there and send the HTTP 200 response
  *
- * @param theDirectory 	the directory in which the index.html cannot be found
+ * @param theDirectory 	the request path of the directory in which the
+ * 						index.html cannot be found
  * @param version 		the version of HTML to send the 200 OK response with
  * @param client_sock	the socket reference to which we are sending our data 
  */
 void createAndSendIndexAndHTTP200(string theDirectory, string version, const int client_sock)
 {
+	TraceSpan span("index");
+
 	//send the response200
 	string response200(version + " 200 OK \r\n");
 	sendData(client_sock, response200.c_str(), response200.length());
 
 	//Creating HTML object to be sent
+	string HTMLObject = buildIndexPage(theDirectory);
+
+	//header and object to send out
+	string header("Content-Length: " + std::to_string(HTMLObject.size()) + "\r\nContent-Type: text/html\r\n\r\n");
+	string objToSend(HTMLObject + "\r\n\r\n");
+	//sending header and object
+	sendData(client_sock, header.c_str(), header.length());
+	sendData(client_sock, objToSend.c_str(), objToSend.length());
+}
+
+/*
+ * builds the HTML listing for a directory that has no index.html
+ *
+ * @param object 	the request path of the directory to list
+ * @return => the HTML page linking to every entry of the directory
+ */
+string buildIndexPage(string object)
+{
+	//the site index already knows the entries and which are directories
+	vector<string> names;
+	SiteIndex::list(object, names);
+
 	string HTMLObject("");
 	HTMLObject += "<html><body><ul>";
-	for (fs::directory_iterator theCurrDir(theDirectory); theCurrDir != fs::directory_iterator(); ++theCurrDir)
+	for (const string &fileName : names)
 	{
-		string fileName = theCurrDir->path().filename().string();
-		if (checkDir(theDirectory + "/" + fileName))
-		{
-			fileName += "/";
-		}
 		HTMLObject += "<li><a href=\"" + fileName + "\">";
 		HTMLObject += fileName + "</a></li>";
 	}	
 	HTMLObject += "</ul></body></html>";
+	return HTMLObject;
+}
 
-	//header and object to send out
-	string header("Content-Length: " + std::to_string(HTMLObject.size()) + "\r\nContent-Type: text/html\r\n\r\n");
-	string objToSend(HTMLObject + "\r\n\r\n");
-	//sending header and object
-	sendData(client_sock, header.c_str(), header.length());
-	sendData(client_sock, objToSend.c_str(), objToSend.length());
+/*
+ * decides what an HTTP/2 request for path gets, following the same rules as
+ * the HTTP/1.x handling in handleClient
+ *
+ * @param path 		the :path of the request
+ * @return => the status, content type and body (file or string) to send
+ */
+Http2Response resolveHttp2(string path)
+{
+	TraceSpan span("h2_resolve");
+	Http2Response response;
+
+	//the proxy only speaks HTTP/1.1 to clients, so send them back to it
+	if (Proxy::enabled() && Proxy::match(path) != nullptr)
+	{
+		response.http1_only = true;
+		return response;
+	}
+
+	//the whole path has to be made of the characters HTTP/1.x allows
+	if (!std::regex_match(path, regex("/[\\w\\./\\-]*")))
+	{
+		response.status = 400;
+		return response;
+	}
+
+	SiteEntry entry = SiteIndex::resolve(path);
+	if ((entry.kind == SiteEntry::DIRECTORY) && (path[path.length() - 1] == '/'))
+	{
+		response.content_type = "text/html";
+		if (entry.has_index)
+		{
+			response.file_fd = SiteIndex::openFile(entry);
+		}
+		else
+		{
+			TraceSpan index_span("index");
+			response.body = buildIndexPage(path);
+		}
+	}
+	else if ((entry.kind == SiteEntry::FILE) && (path[path.length() - 1] != '/'))
+	{
+		response.content_type = entry.mime;
+		response.file_fd = SiteIndex::openFile(entry);
+	}
+	if ((response.status == 200) && response.body.empty() && (response.file_fd < 0))
+	{
+		//missing, or the file could not be opened safely
+		response.status = 404;
+		response.content_type = "text/html";
+		response.body = NOT_FOUND_PAGE;
+	}
+	return response;
+}
+
+/*
+ * checks whether a request asks to switch to cleartext HTTP/2
+ *
+ * @param request_string	the request from the browser in a c++ string
+ * @param settings 			set to the value of the HTTP2-Settings header
+ * @return => true if the request carries "Upgrade: h2c" and HTTP2-Settings
+ */
+bool wantsH2cUpgrade(string request_string, string &settings)
+{
+	smatch upgrade, settingsMatch;
+	regex upgradeForm("\r\nUpgrade:[ \t]*h2c[ \t]*\r\n", std::regex::icase);
+	regex settingsForm("\r\nHTTP2-Settings:[ \t]*([A-Za-z0-9_\\-=]*)[ \t]*\r\n", std::regex::icase);
+	if (!std::regex_search(request_string, upgrade, upgradeForm)
+			|| !std::regex_search(request_string, settingsMatch, settingsForm))
+	{
+		return false;
+	}
+	settings = settingsMatch[1];
+	return true;
+}
+
+/*
+ * switches the connection to HTTP/2 and serves it there, if this worker
+ * can take another HTTP/2 session
+ *
+ * @param client_sock	the socket of the upgrading client
+ * @param object 		the path of the upgrading GET, which becomes stream 1
+ * @param settings 		the value of its HTTP2-Settings header
+ * @return => false if no session slot was free and nothing was sent; the
+ * request should then be answered over HTTP/1.x (ignoring Upgrade is allowed)
+ */
+bool upgradeToHttp2(const int client_sock, string object, string settings)
+{
+	Http2Slot slot;
+	if (!slot.held)
+	{
+		return false;
+	}
+	string response101("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+	sendData(client_sock, response101.c_str(), response101.length());
+	Http2Session session(client_sock, resolveHttp2);
+	session.runUpgraded("GET", object, settings);
+	return true;
 }
 
 /*
@@ -486,46 +1251,109 @@ string getObj(string requestChecked)
 	return regexCheck(requestChecked, "(/[\\w\\./\\-]*)");
 }
 
+/*
+ * gets the request target (path and query string) from the request line,
+ * whatever the method is
+ *
+ * @param request_string	the request from the browser in a c++ string
+ * @return => the target, or "empty" if the request line is malformed
+ */
+string getTarget(string request_string)
+{
+	size_t start = request_string.find(' ');
+	if (start == string::npos)
+	{
+		return "empty";
+	}
+	size_t end = request_string.find_first_of(" \r\n", start + 1);
+	if (end == string::npos)
+	{
+		return "empty";
+	}
+	return request_string.substr(start + 1, end - start - 1);
+}
+
 /*
  * Sends the Header to the server
  *
- * @param object		the string that will be checked for the file type
+ * @param entry			the file (size and type come from the site index)
  * @param cleint_sock	the client socket to which we must send something
  */
-void sendHead(string fileName, const int client_sock)
+void sendHead(const SiteEntry &entry, const int client_sock)
 {
+	TraceSpan span("header");
 	string header("");
 	header += "Content-Length: ";
-	header += std::to_string(fs::file_size(fileName));
+	header += std::to_string(entry.size);
 	header += "\r\n";
 	header += "Content-Type: ";
-	header += fileType(fileName);
+	header += entry.mime;
 	header += "\r\n\r\n";
 	
 	sendData(client_sock, header.c_str(), header.length());	
 }
 
 /*
- * Sends the object to the server
+ * Sends the object to the server: exactly the number of bytes announced in
+ * the header, even if the file is changing underneath us
  *
- * @param fileName		the name of the object we need to send
+ * @param entry			the file we need to send
+ * @param file_fd		the file, opened by SiteIndex::openFile; closed here
  * @param client_sock	the client sock to which we must send something 
  */
-void sendObj(string fileName, const int client_sock)
+void sendObj(const SiteEntry &entry, int file_fd, const int client_sock)
 {
-	std::ifstream file(fileName, std::ios::binary);
-	const unsigned int buffer_size = 4098;
-	char file_data[buffer_size];
-	while(!file.eof())
+	TraceSpan span("body");
+
+	if (Capture::enabled())
 	{
-		file.read(file_data, buffer_size);
-		int bytesRead = file.gcount();
-		sendData(client_sock, file_data, bytesRead);
-		memset(file_data, 0, buffer_size);	
+		//the capture log has to see every byte, so copy through a buffer
+		const unsigned int buffer_size = 4098;
+		char file_data[buffer_size];
+		uint64_t remaining = entry.size;
+		while(remaining > 0)
+		{
+			ssize_t bytesRead = read(file_fd, file_data,
+					std::min<uint64_t>(buffer_size, remaining));
+			if (bytesRead <= 0)
+			{
+				close(file_fd);
+				throw std::system_error(std::error_code(EIO, std::generic_category()),
+						"file shrank while sending");
+			}
+			sendData(client_sock, file_data, bytesRead);
+			remaining -= bytesRead;
+		}
 	}
+	else
+	{
+		//let the kernel move the file straight to the socket (sendfile, or
+		//kTLS for encrypted connections that support it)
+		off_t offset = 0;
+		off_t size = entry.size;
+		while(offset < size)
+		{
+			short wait_for;
+			ssize_t sent = Tls::sendFile(client_sock, file_fd, offset,
+					size - offset, wait_for);
+			if (sent == -1 && (errno == EAGAIN || errno == EINTR))
+			{
+				waitForSocket(client_sock, wait_for);
+				continue;
+			}
+			if (sent <= 0)
+			{
+				std::error_code ec(sent == 0 ? EPIPE : errno, std::generic_category());
+				close(file_fd);
+				throw std::system_error(ec, "sending file failed");
+			}
+			offset += sent;
+		}
+	}
+	close(file_fd);
+
 	string end("\r\n\r\n");
 	sendData(client_sock, end.c_str(), end.length());	
-	file.close();
 }
 
 
@@ -574,43 +1402,35 @@ string fileType(string fileName)
 	return type;
 }
 
-/*
- * Checks if the file is in the working directory
- *
- * @param	fileName	name of the file in the working directory
- * @return 	return true of false dependant if the file exists
- */
-bool checkFile(string fileName)
-{
-	fs::path nameOfFile(fileName);
-	return fs::is_regular_file(nameOfFile);
-}
-
-/*
- * Checks of the Directory is valid (path checking)
- *
- * @param 	thePath		name of the path we need to check
- * @return	return the status (true of false) if the path is valid
- */
-bool checkDir(string thePath)
-{
-	fs::path nameOfPath(thePath);
-	return fs::is_directory(nameOfPath);
-}
-
 /*
  * the loop for consumer threads to run - gets the new socket from the buffer and calls
  * handleClient  
  *
  * @param buffer 	the shared buffer that contains socket numbers
- * @param rootDir 	the root directory provided by the user in the command
- * line arguments 
+ * @param cpu 		the CPU to pin this thread to, or -1 to let it float
  */
-void consumerThread(BoundedBuffer &buffer, string rootDir)
+void consumerThread(BoundedBuffer &buffer, int cpu)
 {
+	if ((cpu >= 0) && !Topology::pinThread(cpu))
+	{
+		perror("Pinning a worker failed");
+		exit(1);
+	}
+	worker_cpu = std::max(cpu, 0);
+
 	while(true)
 	{
 		const int client_sock = buffer.getItem();
-		handleClient(client_sock, rootDir);
+		try {
+			handleClient(client_sock);
+		}
+		catch (const std::exception &e) {
+			// a client that goes away mid-request (std::system_error), or
+			// any other failure serving one connection, must not take the
+			// server (and every other connection) down with it; its capture
+			// and trace still get closed out
+			std::cerr << e.what() << "\n";
+			finishClient(client_sock, string("failed: ") + e.what());
+		}
 	}
 }
@@ -0,0 +1,228 @@
+/**
+ * torero-tls-bench: measures TLS handshake rate (full and resumed) and bulk
+ * download throughput of a torero-serve running with --tls-cert/--tls-key.
+ *
+ * Usage: ./torero-tls-bench (port #) [options]
+ * 	--host ADDR			IPv4 address of the server (default 127.0.0.1)
+ * 	--handshakes N		connections per handshake test (default 1000)
+ * 	--concurrency N		connections in flight at once (default 8)
+ * 	--path PATH			small object requested by the handshake tests
+ * 						(default /index.html)
+ * 	--bulk-path PATH	large object for the throughput test (none by default)
+ * 	--downloads N		times the large object is downloaded (default 20)
+ *
+ * The certificate is not verified; this only talks to a local test server.
+ */
+
+// standard C libraries
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// operating system specific libraries
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// C++ standard libraries
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+using std::cout;
+using std::string;
+using std::vector;
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Outcome of one TLS request.
+ */
+struct Fetch {
+	bool ok = false;
+	bool resumed = false;
+	size_t bytes = 0;
+};
+
+Fetch fetch(SSL_CTX *ctx, const struct sockaddr_in &addr, const string &path,
+		SSL_SESSION **session);
+void runHandshakes(SSL_CTX *ctx, const struct sockaddr_in &addr, const string &path,
+		int count, int concurrency, bool resume);
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cout << "INCORRECT USAGE!\n";
+		cout << "Proper Format: ./torero-tls-bench (port #) [--host ADDR] [--handshakes N] [--concurrency N] [--path PATH] [--bulk-path PATH] [--downloads N]\n";
+		cout << "Example: ./torero-tls-bench 7443 --bulk-path /big.txt\n";
+		exit(1);
+	}
+
+	int port = std::stoi(argv[1]);
+	string host("127.0.0.1");
+	int handshakes = 1000;
+	int concurrency = 8;
+	string path("/index.html");
+	string bulk_path;
+	int downloads = 20;
+
+	for (int i = 2; i < argc; ++i) {
+		string flag(argv[i]);
+		if (i + 1 >= argc) {
+			cout << "Missing value for " << flag << "\n";
+			exit(1);
+		}
+		string value(argv[++i]);
+		if (flag == "--host") {
+			host = value;
+		}
+		else if (flag == "--handshakes") {
+			handshakes = std::max(1, std::stoi(value));
+		}
+		else if (flag == "--concurrency") {
+			concurrency = std::max(1, std::stoi(value));
+		}
+		else if (flag == "--path") {
+			path = value;
+		}
+		else if (flag == "--bulk-path") {
+			bulk_path = value;
+		}
+		else if (flag == "--downloads") {
+			downloads = std::max(1, std::stoi(value));
+		}
+		else {
+			cout << "Unknown option: " << flag << "\n";
+			exit(1);
+		}
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+		std::cerr << "Bad host address: " << host << "\n";
+		exit(1);
+	}
+
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
+
+	runHandshakes(ctx, addr, path, handshakes, concurrency, false);
+	runHandshakes(ctx, addr, path, handshakes, concurrency, true);
+
+	if (!bulk_path.empty()) {
+		size_t total = 0;
+		int failures = 0;
+		Clock::time_point start = Clock::now();
+		for (int i = 0; i < downloads; ++i) {
+			Fetch f = fetch(ctx, addr, bulk_path, nullptr);
+			if (!f.ok) {
+				failures++;
+			}
+			total += f.bytes;
+		}
+		double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+		cout << "bulk: " << downloads << " x " << bulk_path << "  failed: "
+			<< failures << "  " << (total / elapsed / (1024 * 1024)) << " MiB/s\n";
+	}
+
+	SSL_CTX_free(ctx);
+	return 0;
+}
+
+/**
+ * Connects, handshakes, GETs path and reads the response until the server
+ * closes. If session is given, the connection tries to resume *session and
+ * afterwards stores its own session there for the next one.
+ */
+Fetch fetch(SSL_CTX *ctx, const struct sockaddr_in &addr, const string &path,
+		SSL_SESSION **session) {
+	Fetch result;
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0 || connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		if (sock >= 0) {
+			close(sock);
+		}
+		return result;
+	}
+
+	SSL *ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, sock);
+	if (session != nullptr && *session != nullptr) {
+		SSL_set_session(ssl, *session);
+	}
+
+	if (SSL_connect(ssl) == 1) {
+		string request("GET " + path + " HTTP/1.0\r\n\r\n");
+		if (SSL_write(ssl, request.data(), request.size()) > 0) {
+			char buffer[65536];
+			int n;
+			while ((n = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
+				result.bytes += n;
+			}
+			result.ok = result.bytes > 0;
+			result.resumed = SSL_session_reused(ssl);
+			// without a clean shutdown OpenSSL refuses to resume the session
+			SSL_shutdown(ssl);
+		}
+	}
+
+	// by now any TLS 1.3 tickets have arrived, so the session is resumable
+	if (session != nullptr && result.ok) {
+		if (*session != nullptr) {
+			SSL_SESSION_free(*session);
+		}
+		*session = SSL_get1_session(ssl);
+	}
+
+	SSL_free(ssl);
+	close(sock);
+	return result;
+}
+
+/**
+ * Makes count connections (concurrency at a time) and prints the handshake
+ * rate. With resume, every client thread reuses its previous session.
+ */
+void runHandshakes(SSL_CTX *ctx, const struct sockaddr_in &addr, const string &path,
+		int count, int concurrency, bool resume) {
+	std::atomic<int> next(0), failures(0), resumed(0);
+	Clock::time_point start = Clock::now();
+
+	vector<std::thread> clients;
+	for (int i = 0; i < concurrency; ++i) {
+		clients.emplace_back([&]() {
+			SSL_SESSION *session = nullptr;
+			while (next++ < count) {
+				Fetch f = fetch(ctx, addr, path, resume ? &session : nullptr);
+				if (!f.ok) {
+					failures++;
+				}
+				if (f.resumed) {
+					resumed++;
+				}
+			}
+			if (session != nullptr) {
+				SSL_SESSION_free(session);
+			}
+		});
+	}
+	for (std::thread &t : clients) {
+		t.join();
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+	cout << (resume ? "resumed" : "full   ") << " handshakes: " << count
+		<< "  failed: " << failures << "  resumed: " << resumed
+		<< "  " << (count / elapsed) << " conn/s\n";
+}